@@ -11,6 +11,7 @@
  * support multi-threaded programs.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -18,287 +19,1657 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <stdarg.h>
+#include <time.h>
+#include <limits.h>
 #include "MyMalloc.h"
 
-static pthread_mutex_t mutex;
+// Serializes initialization. Each arena has its own lock for the heap.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the list of objects that have their own mapping
+static pthread_mutex_t largeMutex = PTHREAD_MUTEX_INITIALIZER;
+static LargeObject _largeList = { &_largeList, &_largeList, NULL, OBJ_ALLOCATED | OBJ_MMAPPED };
+
+// Protects the slab zone's bump pointer and its list of empty slabs
+static pthread_mutex_t slabMutex = PTHREAD_MUTEX_INITIALIZER;
+static char *_slabZoneTop;
+static char *_slabZoneMapped;
+static Slab *_emptySlabs;
+
+// Serializes the creation of the page map's nodes. The root is static; the
+// nodes below it are mapped on first use and never go away.
+static pthread_mutex_t pagemapMutex = PTHREAD_MUTEX_INITIALIZER;
+static void *_pageMap[PAGEMAP_FANOUT];
+
+const int arenaSize = ARENA_SIZE;
+
+// Size of the free object that spans an entire 2MB chunk, between the
+// chunk's ArenaChunk and its tail fencepost
+#define WHOLE_CHUNK_SIZE (arenaSize - sizeof(ArenaChunk) - HEADER_SIZE)
+
+size_t _heapSize;
+size_t _heapResident;
+int _retainChunks;
+int _bestFit;
+int _addressOrder;
+int _deferCoalescing;
+int _remoteFree;
+size_t _mmapThreshold;
+size_t _profileInterval;
+size_t _largeSize;
+int _slabsEnabled;
+int _hugePages;
+int _lockStats;
+char *_slabZone;
+size_t _slabSize;
+long _decayTime;
+size_t _purgedSize;
+void *_memStart;
+int _initialized;
+int _verbose;
+Arena _arenas[MAX_ARENAS];
+int _numArenas;
+
+// Decay counts time in epochs of half the decay time. Free runs are stamped
+// with the epoch they were freed in, and the thread that advances the epoch
+// is started when the heap starts up, or by the first free of a forked child.
+static unsigned long _decayEpoch;
+static int _decayStarted;
+static void decay_run(ObjectHeader * header);
+static void decay_forked();
+
+// The arena each thread allocates from, and the next arena to hand out
+static __thread Arena *_threadArena __attribute__((tls_model("initial-exec")));
+static int _nextArena;
+
+// Each thread's cache of small chunks. The key only exists to flush the
+// cache back to the heap when the thread exits.
+static __thread ThreadCache _threadCache __attribute__((tls_model("initial-exec")));
+static pthread_key_t _threadCacheKey;
+
+// The heap profiler's table of live samples, a pool of unused samples and
+// each thread's sampling state. The table's buckets are read without the
+// lock by free, to skip objects that cannot have been sampled.
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static ProfileSample **_profileTable;
+static ProfileSample *_profileFree;
+static unsigned long _profileObjects;
+static size_t _profileBytes;
+static const char *_profilePrefix = "mymalloc";
+static int _profileDumps;
+static volatile sig_atomic_t _profileDumpPending;
+static __thread ProfileThread _profileThread __attribute__((tls_model("initial-exec")));
+
+// The trace recorder's file and the time it started. Each thread buffers
+// its records, and buffers of exited threads go to later threads. Records
+// made after a thread's destructor ran are written one at a time.
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static int _traceFd = -1;
+static const char *_tracePrefix;
+static unsigned long _traceStart;
+static unsigned int _traceThreads;
+static TraceBuffer *_traceFree;
+static __thread TraceBuffer *_traceBuffer __attribute__((tls_model("initial-exec")));
+static __thread int _traceRetired __attribute__((tls_model("initial-exec")));
+static void trace_retire();
+static void trace_forked();
+
+// Each thread's statistics. A thread takes a shard when it first counts
+// something and hands it on to a later thread when it exits, so the counts of
+// exited threads stay in the sums. Objects freed after the thread cache's
+// destructor are counted in _statsShared, where threads may race.
+static __thread StatsShard *_threadStats __attribute__((tls_model("initial-exec")));
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static StatsShard _statsShared;
+static StatsShard *_statsShards = &_statsShared;
+static StatsShard *_freeShards;
+
+// Counts what the library allocates for itself through the program's
+// malloc: pthread_create's memory for the decay thread, and the unwinder's
+// for the profiler's first backtrace. It is left out of the sums.
+static StatsShard _internalShard;
+
+// Only the owning thread writes its shard, so a relaxed load and store is
+// enough; stats_get may read the counter at the same time
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+static StatsShard * stats_attach()
+{
+    pthread_mutex_lock(&statsMutex);
+    StatsShard * shard = _freeShards;
+    if (shard != NULL) {
+        _freeShards = shard->_nextFree;
+    } else {
+        shard = (StatsShard *)mmap(NULL, sizeof(StatsShard), PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (shard == MAP_FAILED) {
+            shard = &_statsShared;
+        } else {
+            shard->_next = _statsShards;
+            _statsShards = shard;
+        }
+    }
+    pthread_mutex_unlock(&statsMutex);
+    _threadStats = shard;
+
+    // The shard is handed on with the thread cache's flush when the thread exits
+    if (_initialized && !_threadCache._registered) {
+        pthread_setspecific(_threadCacheKey, &_threadCache);
+        _threadCache._registered = 1;
+    }
+    return shard;
+}
+
+static MallocStats * stats_shard()
+{
+    StatsShard * shard = _threadStats;
+    if (shard == NULL)
+        shard = stats_attach();
+    return &shard->_counts;
+}
+
+static void stats_retire()
+{
+    StatsShard * shard = _threadStats;
+    _threadStats = &_statsShared;
+    if (shard == NULL || shard == &_statsShared)
+        return;
+
+    pthread_mutex_lock(&statsMutex);
+    shard->_nextFree = _freeShards;
+    _freeShards = shard;
+    pthread_mutex_unlock(&statsMutex);
+}
+
+static int stats_class(size_t size)
+{
+    int sizeClass = size > 1 ? 64 - __builtin_clzl(size - 1) : 0;
+    return sizeClass < STATS_SIZE_CLASSES ? sizeClass : STATS_SIZE_CLASSES - 1;
+}
+
+static void stats_allocated(MallocStats * counts, size_t size)
+{
+    STAT_ADD(counts->_bytesAllocated, size);
+    STAT_ADD(counts->_allocations[stats_class(size)], 1);
+}
+
+static void stats_freed(MallocStats * counts, size_t size)
+{
+    STAT_ADD(counts->_bytesFreed, size);
+    STAT_ADD(counts->_deallocations[stats_class(size)], 1);
+}
+
+// When the calling thread took the lock of each kind that it holds. A
+// thread never holds two locks of the same kind.
+static __thread unsigned long _lockTaken[NUM_LOCK_KINDS] __attribute__((tls_model("initial-exec")));
+
+static unsigned long lock_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/*
+ * Counts a lock of the kind that the calling thread has just taken. It
+ * started waiting for it at waitStart, or did not wait if that is 0.
+ */
+static void lock_acquired(int kind, unsigned long waitStart)
+{
+    LockStats * counts = &stats_shard()->_locks[kind];
+    _lockTaken[kind] = lock_now();
+    STAT_ADD(counts->_acquisitions, 1);
+    if (waitStart) {
+        STAT_ADD(counts->_contended, 1);
+        STAT_ADD(counts->_waitNanos, _lockTaken[kind] - waitStart);
+    }
+}
+
+/*
+ * Takes a heap lock, counting it as contention if it has to wait.
+ */
+static void lock_counted(pthread_mutex_t * lock, int kind)
+{
+    if (pthread_mutex_trylock(lock) == 0) {
+        if (_lockStats)
+            lock_acquired(kind, 0);
+        return;
+    }
 
-const int arenaSize = 2097152;
+    STAT_ADD(stats_shard()->_lockContention, 1);
+    unsigned long waitStart = _lockStats ? lock_now() : 0;
+    pthread_mutex_lock(lock);
+    if (_lockStats)
+        lock_acquired(kind, waitStart);
+}
 
-void increaseMallocCalls()  { _mallocCalls++; }
+static void unlock_counted(pthread_mutex_t * lock, int kind)
+{
+    if (_lockStats) {
+        LockStats * counts = &stats_shard()->_locks[kind];
+        unsigned long held = lock_now() - _lockTaken[kind];
+        int bucket = held >> LOCK_HOLD_SHIFT ? 64 - __builtin_clzl(held >> LOCK_HOLD_SHIFT) : 0;
+        if (bucket >= LOCK_HOLD_BUCKETS)
+            bucket = LOCK_HOLD_BUCKETS - 1;
+        STAT_ADD(counts->_holdNanos, held);
+        STAT_ADD(counts->_holds[bucket], 1);
+    }
+    pthread_mutex_unlock(lock);
+}
 
-void increaseReallocCalls() { _reallocCalls++; }
+static void lock_arena(Arena * arena)
+{
+    lock_counted(&arena->_lock, LOCK_ARENA);
+}
 
-void increaseCallocCalls()  { _callocCalls++; }
+static void unlock_arena(Arena * arena)
+{
+    unlock_counted(&arena->_lock, LOCK_ARENA);
+}
 
-void increaseFreeCalls()    { _freeCalls++; }
+static void tc_destructor(void *cache)
+{
+    ThreadCache * tc = (ThreadCache *)cache;
+    tc_flush(tc);
+    stats_retire();
+    trace_retire();
+
+    // Frees made by later destructors re-register the cache, which makes
+    // pthreads call us again on its next destructor pass
+    tc->_registered = 0;
+}
 
 extern void atExitHandlerInC()
 {
     atExitHandler();
 }
 
+/*
+ * Takes every lock of the library before fork, in the order they are
+ * taken, so that no other thread (the decay thread, say) holds one when the
+ * child is made. Only the forking thread lives on in the child, where no
+ * lock is waited for until these are released. The initialization lock
+ * comes first. The profiler's, the trace recorder's and the statistics'
+ * locks come last, since heap locks are held when they are taken but never
+ * the other way round.
+ */
+static void atForkPrepare()
+{
+    int a, i;
+    pthread_mutex_lock(&mutex);
+    for (a = 0; a < _numArenas; a++)
+        pthread_mutex_lock(&_arenas[a]._growLock);
+    for (a = 0; a < _numArenas; a++)
+        pthread_mutex_lock(&_arenas[a]._lock);
+    for (a = 0; a < _numArenas; a++) {
+        for (i = 0; i < NUM_SLAB_CLASSES; i++)
+            pthread_mutex_lock(&_arenas[a]._slabLocks[i]);
+    }
+    pthread_mutex_lock(&slabMutex);
+    pthread_mutex_lock(&largeMutex);
+    pthread_mutex_lock(&pagemapMutex);
+    pthread_mutex_lock(&profileMutex);
+    pthread_mutex_lock(&traceMutex);
+    pthread_mutex_lock(&statsMutex);
+}
+
+static void atForkRelease()
+{
+    int a, i;
+    pthread_mutex_unlock(&statsMutex);
+    pthread_mutex_unlock(&traceMutex);
+    pthread_mutex_unlock(&profileMutex);
+    pthread_mutex_unlock(&pagemapMutex);
+    pthread_mutex_unlock(&largeMutex);
+    pthread_mutex_unlock(&slabMutex);
+    for (a = _numArenas - 1; a >= 0; a--) {
+        for (i = NUM_SLAB_CLASSES - 1; i >= 0; i--)
+            pthread_mutex_unlock(&_arenas[a]._slabLocks[i]);
+    }
+    for (a = _numArenas - 1; a >= 0; a--)
+        pthread_mutex_unlock(&_arenas[a]._lock);
+    for (a = _numArenas - 1; a >= 0; a--)
+        pthread_mutex_unlock(&_arenas[a]._growLock);
+    pthread_mutex_unlock(&mutex);
+}
+
+// Threads do not survive fork, and neither should the child's trace file
+static void atForkChild()
+{
+    atForkRelease();
+    decay_forked();
+    trace_forked();
+}
+
 /* 
- * Initial setup of allocator. First chunk is retrieved from the OS,
- * and the fence posts and freeList are initialized.
+ * Initial setup of allocator. The arenas and their bins are initialized and
+ * the first chunk is retrieved from the OS with its fence posts. Other arenas
+ * get their first chunk when they are first used.
  */
 void initialize()
 {
+    pthread_mutex_lock(&mutex);
+    if (_initialized) {
+        // Another thread got here first
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+
     // Environment var VERBOSE prints stats at end and turns on debugging
-    // Default is on
+    // Default is on. MALLOCVERBOSE=FULL also prints the allocator's own
+    // statistics after the ones the test references expect
     _verbose = 1;
     const char *envverbose = getenv("MALLOCVERBOSE");
     if (envverbose && !strcmp(envverbose, "NO")) {
         _verbose = 0;
     }
-
-    pthread_mutex_init(&mutex, NULL);
-    void *_mem = getMemoryFromOS(arenaSize);
+    if (envverbose && !strcmp(envverbose, "FULL")) {
+        _verbose = 2;
+    }
 
     // In verbose mode register also printing statistics at exit
     atexit(atExitHandlerInC);
 
-    // establish fence posts
-    ObjectHeader * fencePostHead = (ObjectHeader *)_mem;
-    fencePostHead->_allocated = 1;
-    fencePostHead->_objectSize = 0;
-
-    char *temp = (char *)_mem + arenaSize - sizeof(ObjectHeader);
-    ObjectHeader * fencePostFoot = (ObjectHeader *)temp;
-    fencePostFoot->_allocated = 1;
-    fencePostFoot->_objectSize = 0;
-
-    // Set up the sentinel as the start of the freeList
-    _freeList = &_freeListSentinel;
-
-    // Initialize the list to point to the _mem
-    temp = (char *)_mem + sizeof(ObjectHeader);
-    ObjectHeader *currentHeader = (ObjectHeader *)temp;
-    currentHeader->_objectSize = arenaSize - (2*sizeof(ObjectHeader)); // ~2MB
-    currentHeader->_leftObjectSize = 0;
-    currentHeader->_allocated = 0;
-    currentHeader->_listNext = _freeList;
-    currentHeader->_listPrev = _freeList;
-    _freeList->_listNext = currentHeader;
-    _freeList->_listPrev = currentHeader;
+    // Environment var MALLOCARENAS sets the number of arenas.
+    // Default is two per CPU
+    _numArenas = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    const char *envarenas = getenv("MALLOCARENAS");
+    if (envarenas) {
+        _numArenas = atoi(envarenas);
+    }
+    if (_numArenas < 1)
+        _numArenas = 1;
+    if (_numArenas > MAX_ARENAS)
+        _numArenas = MAX_ARENAS;
+
+    // Environment var MALLOCRETAIN sets how many empty 2MB chunks each
+    // arena keeps mapped for reuse. Default is 1
+    _retainChunks = 1;
+    const char *envretain = getenv("MALLOCRETAIN");
+    if (envretain) {
+        _retainChunks = atoi(envretain);
+    }
+
+    // Environment var MALLOCFIT=FIRST takes large chunks from the first
+    // bin that fits instead of the best fit from the tree. MALLOCFIT=ADDRESS
+    // takes the lowest chunk that fits from the tree instead, and defers
+    // coalescing small objects to quick lists. Default is best fit
+    _bestFit = 1;
+    _addressOrder = 0;
+    _deferCoalescing = 0;
+    const char *envfit = getenv("MALLOCFIT");
+    if (envfit && !strcmp(envfit, "FIRST")) {
+        _bestFit = 0;
+    }
+    if (envfit && !strcmp(envfit, "ADDRESS")) {
+        _addressOrder = 1;
+        _deferCoalescing = 1;
+    }
+
+    // Environment var MALLOCREMOTEFREE=NO makes a thread free objects of
+    // other arenas under their lock. Default is to push them onto the
+    // arena's remote frees for its own threads to free
+    _remoteFree = 1;
+    const char *envremote = getenv("MALLOCREMOTEFREE");
+    if (envremote && !strcmp(envremote, "NO")) {
+        _remoteFree = 0;
+    }
+
+    // Environment var MALLOCMMAPTHRESHOLD sets the smallest request that
+    // gets a mapping of its own. Default is 256KB
+    _mmapThreshold = 262144;
+    const char *envthreshold = getenv("MALLOCMMAPTHRESHOLD");
+    if (envthreshold) {
+        _mmapThreshold = strtoul(envthreshold, NULL, 10);
+    }
+
+    // Environment var MALLOCPROFILE turns on the heap profiler, sampling
+    // about one allocation per that many bytes. MALLOCPROFILEFILE names the
+    // profiles it writes at exit and on SIGUSR2. Default is off
+    const char *envprofile = getenv("MALLOCPROFILE");
+    const char *envprofilefile = getenv("MALLOCPROFILEFILE");
+    if (envprofilefile) {
+        _profilePrefix = envprofilefile;
+    }
+    if (envprofile && strtoul(envprofile, NULL, 10) > 0) {
+        profile_start(strtoul(envprofile, NULL, 10));
+    }
+
+    // Environment var MALLOCTRACE records every call to a file named after
+    // it and the process id. Default is off
+    const char *envtrace = getenv("MALLOCTRACE");
+    if (envtrace) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s.%d.trace", envtrace, getpid());
+        _tracePrefix = envtrace;
+        trace_start(path);
+    }
+
+    // Environment var MALLOCSLABS=NO serves small objects from the bins
+    // like any other object. Default is to use slabs
+    _slabsEnabled = 1;
+    const char *envslabs = getenv("MALLOCSLABS");
+    if (envslabs && !strcmp(envslabs, "NO")) {
+        _slabsEnabled = 0;
+    }
+
+    // Environment var MALLOCDECAY sets how many milliseconds a free run of
+    // DECAY_MIN_SIZE bytes or more stays resident before its pages are
+    // given back. 0 gives them back at once, a negative value never.
+    // Default is 5000
+    _decayTime = 5000;
+    const char *envdecay = getenv("MALLOCDECAY");
+    if (envdecay) {
+        _decayTime = strtol(envdecay, NULL, 10);
+    }
+
+    // Environment var MALLOCHUGEPAGES=YES asks the kernel to back the 2MB
+    // chunks and the slab zone with transparent huge pages. Default is off
+    _hugePages = 0;
+    const char *envhuge = getenv("MALLOCHUGEPAGES");
+    if (envhuge && !strcmp(envhuge, "YES")) {
+        _hugePages = 1;
+    }
+
+    // Environment var MALLOCLOCKSTATS=YES times every heap lock's waits and
+    // holds for stats_get and the exit report. Default is off
+    _lockStats = 0;
+    const char *envlockstats = getenv("MALLOCLOCKSTATS");
+    if (envlockstats && !strcmp(envlockstats, "YES")) {
+        _lockStats = 1;
+    }
+
+    // Reserve address space for the slabs. Pages only become accessible
+    // when a slab is carved out of the zone. With huge pages the zone is
+    // 2MB-aligned and made accessible a huge page at a time.
+    if (_slabsEnabled) {
+        size_t zoneAlign = _hugePages ? arenaSize : SLAB_SIZE;
+        char *zone = (char *)mmap(NULL, SLAB_ZONE_SIZE + zoneAlign, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (zone == MAP_FAILED) {
+            _slabsEnabled = 0;
+        } else {
+            _slabZone = (char *)(((unsigned long)zone + zoneAlign - 1) & ~((unsigned long)zoneAlign - 1));
+            _slabZoneTop = _slabZone;
+            _slabZoneMapped = _slabZone;
+            if (_hugePages)
+                madvise(_slabZone, SLAB_ZONE_SIZE, MADV_HUGEPAGE);
+        }
+    }
+
+    // Every bin starts out as an empty circular list around its sentinel
+    int a, i;
+    for (a = 0; a < _numArenas; a++) {
+        Arena * arena = &_arenas[a];
+        pthread_mutex_init(&arena->_lock, NULL);
+        pthread_mutex_init(&arena->_growLock, NULL);
+        for (i = 0; i < NUM_SLAB_CLASSES; i++) {
+            pthread_mutex_init(&arena->_slabLocks[i], NULL);
+        }
+        for (i = 0; i < NUM_BINS; i++) {
+            arena->_freeBins[i]._listNext = &arena->_freeBins[i];
+            arena->_freeBins[i]._listPrev = &arena->_freeBins[i];
+        }
+        memset(arena->_binMap, 0, sizeof(arena->_binMap));
+        arena->_tree = NULL;
+        memset(arena->_slabs, 0, sizeof(arena->_slabs));
+        arena->_chunks._next = &arena->_chunks;
+        arena->_chunks._prev = &arena->_chunks;
+        arena->_emptyChunks = 0;
+        memset(arena->_quickLists, 0, sizeof(arena->_quickLists));
+        arena->_quickCount = 0;
+        arena->_remoteFrees = NULL;
+        arena->_index = a;
+    }
+
+    pthread_key_create(&_threadCacheKey, tc_destructor);
+    pthread_atfork(atForkPrepare, atForkRelease, atForkChild);
+
+    // Get the first 2MB chunk with its fence posts
+    ObjectHeader *currentHeader = fl_create(&_arenas[0], 0);
 
     // Set the start of the allocated memory
     _memStart = (char *)currentHeader;
 
-    _initialized = 1;
+    __atomic_store_n(&_initialized, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mutex);
+
+    // Whatever pthread_create allocates goes into the first chunk now,
+    // rather than into a later chunk that it would keep from being unmapped
+    decay_start();
+}
+
+/*
+ * Threads are handed arenas round-robin the first time they allocate. When
+ * a thread finds its arena locked, it moves to the first other arena it can
+ * lock without waiting, so threads drift away from contended arenas. Objects
+ * other threads freed into the arena meanwhile are freed before returning.
+ */
+Arena * arena_get()
+{
+    // Make sure that allocator is initialized
+    if (!__atomic_load_n(&_initialized, __ATOMIC_ACQUIRE))
+        initialize();
+
+    Arena * arena = _threadArena;
+    if (arena == NULL) {
+        int next = __atomic_fetch_add(&_nextArena, 1, __ATOMIC_RELAXED);
+        arena = &_arenas[next % _numArenas];
+        _threadArena = arena;
+    }
+    return arena;
+}
+
+Arena * arena_lock()
+{
+    Arena * arena = arena_get();
+
+    Arena * locked = NULL;
+    if (pthread_mutex_trylock(&arena->_lock) == 0)
+        locked = arena;
+    else
+        STAT_ADD(stats_shard()->_lockContention, 1);
+
+    int i;
+    for (i = 1; locked == NULL && i < _numArenas; i++) {
+        Arena * other = &_arenas[(arena->_index + i) % _numArenas];
+        if (pthread_mutex_trylock(&other->_lock) == 0) {
+            _threadArena = other;
+            locked = other;
+        }
+    }
+
+    if (locked != NULL) {
+        if (_lockStats)
+            lock_acquired(LOCK_ARENA, 0);
+    } else {
+        unsigned long waitStart = _lockStats ? lock_now() : 0;
+        pthread_mutex_lock(&arena->_lock);
+        if (_lockStats)
+            lock_acquired(LOCK_ARENA, waitStart);
+        locked = arena;
+    }
+
+    if (__atomic_load_n(&locked->_remoteFrees, __ATOMIC_RELAXED) != NULL)
+        arena_drain(locked);
+    return locked;
+}
+
+/*
+ * A thread that frees an object of an arena it does not allocate from
+ * pushes it onto the arena's remote frees, a lock-free stack, instead of
+ * waiting for the arena's lock. The threads of the arena free the whole
+ * stack at once the next time they lock it.
+ */
+int remote_free(Arena * arena, void * ptr)
+{
+    if (!_remoteFree || arena == _threadArena)
+        return 0;
+
+    void * head = __atomic_load_n(&arena->_remoteFrees, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&arena->_remoteFrees, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+void arena_drain(Arena * arena)
+{
+    // Taking the whole stack at once means a node is never popped while
+    // a pusher still looks at it
+    void * ptr = __atomic_exchange_n(&arena->_remoteFrees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void * next = *(void **)ptr;
+        freeObject(ptr);
+        ptr = next;
+    }
+}
+
+Arena * arena_of(ObjectHeader * header)
+{
+    if (header->_objectSize & OBJ_MMAPPED)
+        return NULL;
+    return CHUNK_OF(header)->_arena;
+}
+
+/*
+ * Returns the number of bytes the caller may use at ptr.
+ */
+size_t objectSize(void *ptr)
+{
+    if (is_slab(ptr))
+        return SLAB_OF(ptr)->_objectSize;
+
+    ObjectHeader * header = (ObjectHeader *)((char *)ptr - HEADER_SIZE);
+    if (header->_objectSize & OBJ_MMAPPED) {
+        LargeObject * large = LARGE_OF(header);
+        return large->_mapStart + OBJ_SIZE(header) - (char *)ptr;
+    }
+    return OBJ_SIZE(header) - HEADER_SIZE;
+}
+
+/*
+ * Returns the size of the object that holds size bytes of payload: the
+ * header is added and the total is rounded up to OBJECT_ALIGN, but never
+ * below the size a free object needs for its links and footer.
+ */
+static size_t objectSizeFor(size_t size)
+{
+    size_t roundedSize = (size + HEADER_SIZE + OBJECT_ALIGN - 1) & ~(size_t)(OBJECT_ALIGN - 1);
+    return roundedSize < MIN_OBJECT_SIZE ? MIN_OBJECT_SIZE : roundedSize;
+}
+
+/*
+ * Writes the footer of a free object, the copy of its size in its last word.
+ */
+static void setFooter(ObjectHeader * header)
+{
+    *(size_t *)((char *)header + OBJ_SIZE(header) - HEADER_SIZE) = OBJ_SIZE(header);
 }
 
 /* 
  * @param: amount of memory requested
  * @return: pointer to start of useable memory
  */
-void * allocateObject(size_t size)
+void * allocateObject(Arena * arena, size_t size)
 {
-    // Make sure that allocator is initialized
-    if (!_initialized)
-        initialize();
+    // Requests that cannot fit in a 2MB chunk must be mapped on their own
+    if (size > WHOLE_CHUNK_SIZE - HEADER_SIZE) {
+      errno = ENOMEM;
+      return NULL;
+    }
 
-    /* Add the ObjectHeader to the size and round the total size up to a 
-     * multiple of 8 bytes for alignment.
+    /* Add the header to the size and round the total size up to a 
+     * multiple of 16 bytes for alignment.
      */
-    size_t roundedSize = (size + sizeof(ObjectHeader) + 7) & ~7;
+    size_t roundedSize = objectSizeFor(size);
+
+    // A quick list may hold an object of just this size, ready to go
+    if (_deferCoalescing && roundedSize < QUICK_LIMIT) {
+      ObjectHeader * quick = quick_pop(arena, roundedSize);
+      if (quick != NULL) {
+        return (char *)quick + HEADER_SIZE;
+      }
+    }
     
-    // fl_search will traverse the freelist and return a pointer to the first
-    // header which has enough memory for roundedSize; return NULL if we don't find
-    // a header with sufficient memory.
-    ObjectHeader * memChunk = fl_search(roundedSize);
+    // fl_search uses the bin bitmap to find a header which has enough memory
+    // for roundedSize; return NULL if no bin holds a header with sufficient memory.
+    ObjectHeader * memChunk = fl_search(arena, roundedSize);
+
+    // The objects in the quick lists may coalesce into a chunk that fits
+    if (memChunk == NULL && arena->_quickCount && quick_sweep(arena)) {
+      memChunk = fl_search(arena, roundedSize);
+    }
 
     // If it turns out that fl_search could not find a sufficient header, we call
-    // fl_insert which will add a block to the beginning of the freelist and return
-    // a pointer to it.
+    // fl_create which will add a new 2MB block to the arena's bins and return a pointer to it.
     if (memChunk == NULL) {
-      memChunk = fl_create();
+      memChunk = fl_create(arena, roundedSize);
     }
     
-    assert(memChunk != NULL);
+    if (memChunk == NULL) {
+      // The OS is out of memory
+      errno = ENOMEM;
+      return NULL;
+    }
 
     // We have now guaranteed that memChunk points to a header with memory that is 
-    // greater or equal to roundedSize. Now we should check if we should split the chunk 
-    // of memory or not. (i.e. after splitting do we have enough space for a header 
-    // + 8 bytes?)
+    // greater or equal to roundedSize. It leaves its bin either way, since its
+    // size is about to change or it is about to be allocated.
+    fl_remove(memChunk);
+    if (OBJ_SIZE(memChunk) == WHOLE_CHUNK_SIZE) {
+      arena->_emptyChunks--;
+    }
+
+    // Now we should check if we should split the chunk of memory or not.
+    // (i.e. after splitting is the rest big enough to be a free object?)
     ObjectHeader * _mem = NULL;
-    if (memChunk->_objectSize - roundedSize >= sizeof(ObjectHeader) + 8) {
-      // We have enough space for another memory chunk, split the block 
+    if (OBJ_SIZE(memChunk) - roundedSize >= MIN_OBJECT_SIZE) {
+      // We have enough space for another memory chunk, split the block and
+      // put the leftover back in the bin for its new size
       _mem = split_chunk(memChunk, roundedSize); 
+      fl_insert(memChunk);
     } else {
       // We didn't have enough space for another memory chunk, don't split the block
-      // Remove the chunk from the freelist
       _mem = memChunk;
-      fl_remove(memChunk);
     }
 
     assert(_mem != NULL);
     
-    _mem->_allocated = 1;
-    // _mem now contains a pointer to the header of the memory we want to allocated,
-    // we have asserted that it does not point to NULL
-
-    pthread_mutex_unlock(&mutex);
+    _mem->_objectSize |= OBJ_ALLOCATED;
+    ObjectHeader * rightHeader = (ObjectHeader *)((char *)_mem + OBJ_SIZE(_mem));
+    rightHeader->_objectSize |= OBJ_LEFT_ALLOCATED;
+
+    // The only words of a zeroed object that were written to are its free
+    // list links or tree node and its footer
+    if (_mem->_objectSize & OBJ_ZEROED) {
+      size_t dirty = OBJ_SIZE(_mem) < sizeof(TreeChunk) ? OBJ_SIZE(_mem) : sizeof(TreeChunk);
+      memset((char *)_mem + HEADER_SIZE, 0, dirty - HEADER_SIZE);
+      *(size_t *)((char *)rightHeader - HEADER_SIZE) = 0;
+    }
 
     // Return a pointer to useable memory
-    return (void *)((char *)_mem + sizeof(ObjectHeader));
+    return (void *)((char *)_mem + HEADER_SIZE);
 }
 
-/* 
- * @param: pointer to the beginning of the block to be returned
- * Note: ptr points to beginning of useable memory, not the block's header
+/*
+ * Carves an object whose memory starts at a multiple of alignment out of a
+ * free chunk. The slack in front of the aligned object and the tail behind
+ * it go back to the bins, so only the object itself is taken.
+ *
+ * @param: power of two greater than OBJECT_ALIGN and amount of memory requested
+ * @return: pointer to start of useable memory
  */
-void freeObject(void *ptr)
+void * allocateAlignedObject(Arena * arena, size_t alignment, size_t size)
 {
-    ObjectHeader * centerHeader = (ObjectHeader *)((char *)ptr - sizeof(ObjectHeader));
-    centerHeader->_allocated = 0;
+    // The leading slack is either empty or big enough to be a free object,
+    // so the chunk must have room for both on top of the object
+    if (size > WHOLE_CHUNK_SIZE - HEADER_SIZE ||
+        objectSizeFor(size) + alignment + MIN_OBJECT_SIZE > WHOLE_CHUNK_SIZE) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    size_t roundedSize = objectSizeFor(size);
 
-    // Check if right header is alloc'd, if so absorb it into center
-    ObjectHeader * rightHeader = (ObjectHeader *)((char *)centerHeader + centerHeader->_objectSize);
-    
-    if (!rightHeader->_allocated) {
-      // Remove rightHeader from freelist
-      fl_remove(rightHeader);
+    ObjectHeader * memChunk = fl_search(arena, roundedSize + alignment + MIN_OBJECT_SIZE);
+    if (memChunk == NULL && arena->_quickCount && quick_sweep(arena)) {
+      memChunk = fl_search(arena, roundedSize + alignment + MIN_OBJECT_SIZE);
+    }
+    if (memChunk == NULL) {
+      memChunk = fl_create(arena, roundedSize + alignment + MIN_OBJECT_SIZE);
+    }
+    if (memChunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
 
-      // Update centerHeader's fields
-      centerHeader->_objectSize += rightHeader->_objectSize;
-      
-      // Update header right of the rightHeader (if it's not a dummy)
-      ObjectHeader * farRightHeader = (ObjectHeader *)((char*)rightHeader + rightHeader->_objectSize);
-      if (farRightHeader->_objectSize) {
-        farRightHeader->_leftObjectSize = centerHeader->_objectSize;
-      }
+    fl_remove(memChunk);
+    if (OBJ_SIZE(memChunk) == WHOLE_CHUNK_SIZE) {
+      arena->_emptyChunks--;
     }
 
-    // Check if left header is alloc'd, if so absorb center into left
-    ObjectHeader * leftHeader = (ObjectHeader *)((char *)centerHeader - centerHeader->_leftObjectSize);
-    if (!leftHeader->_allocated) {
-      // Update leftHeader's fields
-      leftHeader->_objectSize += centerHeader->_objectSize;
+    // Find the first aligned address that leaves no slack, or enough slack
+    // for a free object
+    unsigned long start = (unsigned long)memChunk + HEADER_SIZE;
+    unsigned long aligned = (start + alignment - 1) & ~(unsigned long)(alignment - 1);
+    if (aligned != start && aligned - start < MIN_OBJECT_SIZE) {
+      aligned += alignment;
+    }
 
-      // Update header right of leftHeader (if it's not a dummy)
-      ObjectHeader * farRightHeader = (ObjectHeader *)((char *)centerHeader + centerHeader->_objectSize);
-      if (farRightHeader->_objectSize) {
-        farRightHeader->_leftObjectSize = leftHeader->_objectSize;
-      }
+    ObjectHeader * _mem = memChunk;
+    if (aligned != start) {
+      // The slack keeps the chunk's left neighbour and zeroed flags, and the
+      // aligned object now has a free object to its left
+      size_t lead = aligned - start;
+      _mem = (ObjectHeader *)((char *)memChunk + lead);
+      _mem->_objectSize = (OBJ_SIZE(memChunk) - lead) | (memChunk->_objectSize & OBJ_ZEROED);
+      memChunk->_objectSize = lead | (memChunk->_objectSize & OBJ_FLAGS);
+      setFooter(memChunk);
+      fl_insert(memChunk);
     }
-    // Otherwise, insert center into freelist
-    else {
-      fl_insert(centerHeader);
+
+    // The tail goes back as well if it is big enough to be an object
+    if (OBJ_SIZE(_mem) - roundedSize >= MIN_OBJECT_SIZE) {
+      ObjectHeader * tail = (ObjectHeader *)((char *)_mem + roundedSize);
+      tail->_objectSize = (OBJ_SIZE(_mem) - roundedSize) | OBJ_LEFT_ALLOCATED |
+                          (_mem->_objectSize & OBJ_ZEROED);
+      setFooter(tail);
+      if (!(tail->_objectSize & OBJ_ZEROED) && OBJ_SIZE(tail) >= DECAY_MIN_SIZE)
+        DECAY_STAMP(tail) = _decayEpoch;
+      fl_insert(tail);
+      _mem->_objectSize = roundedSize | (_mem->_objectSize & OBJ_FLAGS);
+    } else {
+      ObjectHeader * rightHeader = (ObjectHeader *)((char *)_mem + OBJ_SIZE(_mem));
+      rightHeader->_objectSize |= OBJ_LEFT_ALLOCATED;
     }
-    return;
+
+    // Aligned objects never go to calloc, so the zeroed flag is simply dropped
+    _mem->_objectSize = (_mem->_objectSize | OBJ_ALLOCATED) & ~(size_t)OBJ_ZEROED;
+
+    return (void *)((char *)_mem + HEADER_SIZE);
 }
 
-/* 
- * Prints the current state of the heap.
+/*
+ * Cuts an allocated block into count allocated objects of roundedSize
+ * bytes. Every piece but the first has an allocated left neighbour; the
+ * first keeps the block's bit. The last piece keeps any slack that
+ * allocateObject chose not to split off.
  */
-void print()
+static void cutBlock(ObjectHeader * blockHeader, size_t roundedSize, int count)
 {
-    printf("\n-------------------\n");
-
-    printf("HeapSize:\t%zd bytes\n", _heapSize );
-    printf("# mallocs:\t%d\n", _mallocCalls );
-    printf("# reallocs:\t%d\n", _reallocCalls );
-    printf("# callocs:\t%d\n", _callocCalls );
-    printf("# frees:\t%d\n", _freeCalls );
+    ObjectHeader * rightHeader = (ObjectHeader *)((char *)blockHeader + OBJ_SIZE(blockHeader));
+    size_t leftAllocated = blockHeader->_objectSize & OBJ_LEFT_ALLOCATED;
+    int i;
+    for (i = 0; i < count; i++) {
+      ObjectHeader * piece = (ObjectHeader *)((char *)blockHeader + i * roundedSize);
+      piece->_objectSize = roundedSize | OBJ_ALLOCATED | leftAllocated;
+      leftAllocated = OBJ_LEFT_ALLOCATED;
+    }
 
-    printf("\n-------------------\n");
+    ObjectHeader * last = (ObjectHeader *)((char *)blockHeader + (count - 1) * roundedSize);
+    last->_objectSize = ((char *)rightHeader - (char *)last) | OBJ_ALLOCATED | OBJ_LEFT_ALLOCATED;
 }
 
-/* 
- * Prints the current state of the freeList
+/*
+ * Allocates count objects of the same size from a locked arena, carving
+ * them out of as few blocks as fit in a chunk.
+ *
+ * @param: amount of memory requested for each object, their number and
+ *         the array that receives them
+ * @return: number of objects allocated, less than count if the OS is out
+ *          of memory
  */
-void print_list() {
-    printf("FreeList: ");
-    if (!_initialized) 
-        initialize();
+size_t allocateObjects(Arena * arena, size_t size, size_t count, void ** ptrs)
+{
+    if (size > WHOLE_CHUNK_SIZE - HEADER_SIZE) {
+      errno = ENOMEM;
+      return 0;
+    }
 
-    ObjectHeader * ptr = _freeList->_listNext;
+    size_t roundedSize = objectSizeFor(size);
+    size_t perBlock = WHOLE_CHUNK_SIZE / roundedSize;
+    size_t done = 0;
+    while (done < count) {
+      size_t pieces = count - done < perBlock ? count - done : perBlock;
+      char * block = (char *)allocateObject(arena, roundedSize * pieces - HEADER_SIZE);
+      if (block == NULL) {
+        break;
+      }
 
-    while (ptr != _freeList) {
-        long offset = (long)ptr - (long)_memStart;
-        printf("[offset:%ld,size:%zd]", offset, ptr->_objectSize);
-        ptr = ptr->_listNext;
-        if (ptr != NULL)
-            printf("->");
+      ObjectHeader * blockHeader = (ObjectHeader *)(block - HEADER_SIZE);
+      cutBlock(blockHeader, roundedSize, pieces);
+      size_t i;
+      for (i = 0; i < pieces; i++) {
+        ptrs[done++] = block + i * roundedSize;
+      }
     }
-    printf("\n");
+    return done;
 }
 
-/* 
- * This function employs the actual system call, sbrk, that retrieves memory
- * from the OS.
+/*
+ * Shrinks an object by splitting off its tail, or grows it by absorbing a
+ * free right neighbour, the same one freeObject would coalesce with.
  *
- * @param: the chunk size that is requested from the OS
- * @return: pointer to the beginning of the chunk retrieved from the OS
+ * @param: header of an allocated object and the new amount of memory requested
+ * @return: 1 if the object now holds size bytes, 0 if it would have to move
  */
-void * getMemoryFromOS(size_t size)
+int reallocObject(ObjectHeader * header, size_t size)
 {
-    _heapSize += size;
+    if (size > WHOLE_CHUNK_SIZE - HEADER_SIZE)
+      return 0;
 
-    // Use sbrk() to get memory from OS
-    void *_mem = sbrk(size);
+    size_t roundedSize = objectSizeFor(size);
+    size_t currentSize = OBJ_SIZE(header);
 
-    // if the list hasn't been initialized, initialize memStart to mem
-    if (!_initialized)
-        _memStart = _mem;
+    if (roundedSize > currentSize) {
+      ObjectHeader * rightHeader = (ObjectHeader *)((char *)header + currentSize);
+      if ((rightHeader->_objectSize & OBJ_ALLOCATED) || currentSize + OBJ_SIZE(rightHeader) < roundedSize)
+        return 0;
 
-    return _mem;
-}
+      // Absorb the right neighbour. The object now borders whatever was to
+      // the right of it, which is allocated since free objects never touch.
+      fl_remove(rightHeader);
+      currentSize += OBJ_SIZE(rightHeader);
+      header->_objectSize = currentSize | (header->_objectSize & OBJ_FLAGS);
 
-void atExitHandler()
-{
-    // Print statistics when exit
-    if (_verbose)
-        print();
+      ObjectHeader * farRightHeader = (ObjectHeader *)((char *)header + currentSize);
+      farRightHeader->_objectSize |= OBJ_LEFT_ALLOCATED;
+    }
+
+    // Give back the tail if it is big enough to be an object of its own.
+    // It is set up as an allocated object and freed, so that it coalesces
+    // with whatever is free to its right.
+    if (currentSize - roundedSize >= MIN_OBJECT_SIZE) {
+      ObjectHeader * tail = (ObjectHeader *)((char *)header + roundedSize);
+      tail->_objectSize = (currentSize - roundedSize) | OBJ_ALLOCATED | OBJ_LEFT_ALLOCATED;
+      header->_objectSize = roundedSize | (header->_objectSize & OBJ_FLAGS);
+
+      freeObject((char *)tail + HEADER_SIZE);
+    }
+    return 1;
 }
 
 /*
- * C interface
+ * Large objects bypass the arenas. Each one is a mapping of its own that
+ * starts with a LargeObject, so freeing it gives the memory straight back
+ * to the OS and resizing it never copies more than mremap does.
+ *
+ * The LargeObject sits right before the memory, which a mapping start
+ * aligns to sizeof(LargeObject). Stricter alignments map extra room and
+ * unmap the whole pages on either side of the aligned object.
+ *
+ * @param: amount of memory requested and a power of two to align it to
+ * @return: pointer to start of useable memory
  */
-
-extern void * malloc(size_t size)
+void * allocateLargeObject(size_t size, size_t alignment)
 {
-    pthread_mutex_lock(&mutex);
-    increaseMallocCalls();
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t slack = alignment > sizeof(LargeObject) ? alignment : 0;
+    size_t mapSize = (size + sizeof(LargeObject) + slack + pageSize - 1) & ~(pageSize - 1);
+    if (mapSize < size) {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+    char * map = (char *)mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+      errno = ENOMEM;
+      return NULL;
+    }
+
+    unsigned long memory = ((unsigned long)map + sizeof(LargeObject) + alignment - 1) & ~(unsigned long)(alignment - 1);
+    LargeObject * large = (LargeObject *)memory - 1;
+    if (slack) {
+      char * first = (char *)((unsigned long)large & ~(unsigned long)(pageSize - 1));
+      char * end = (char *)((memory + size + pageSize - 1) & ~(unsigned long)(pageSize - 1));
+      if (first > map)
+        munmap(map, first - map);
+      if (end < map + mapSize)
+        munmap(end, map + mapSize - end);
+      map = first;
+      mapSize = end - first;
+    }
 
-    return allocateObject(size);
+    if (!pagemap_set(map, mapSize, large, PAGE_LARGE)) {
+      munmap(map, mapSize);
+      errno = ENOMEM;
+      return NULL;
+    }
+    large->_mapStart = map;
+    large->_objectSize = mapSize | OBJ_ALLOCATED | OBJ_MMAPPED | OBJ_ZEROED;
+
+    lock_counted(&largeMutex, LOCK_LARGE);
+    large->_next = _largeList._next;
+    large->_prev = &_largeList;
+    _largeList._next->_prev = large;
+    _largeList._next = large;
+    _largeSize += mapSize;
+    unlock_counted(&largeMutex, LOCK_LARGE);
+
+    return (void *)(large + 1);
 }
 
-extern void free(void *ptr)
+void freeLargeObject(ObjectHeader * header)
 {
-    pthread_mutex_lock(&mutex);
-    increaseFreeCalls();
+    LargeObject * large = LARGE_OF(header);
 
-    if (ptr == 0) {
-        // No object to free
-        pthread_mutex_unlock(&mutex);
-        return;
-    }
+    lock_counted(&largeMutex, LOCK_LARGE);
+    large->_prev->_next = large->_next;
+    large->_next->_prev = large->_prev;
+    _largeSize -= OBJ_SIZE(header);
+    unlock_counted(&largeMutex, LOCK_LARGE);
 
-    freeObject(ptr);
+    // Out of the map before the pages can be mapped again for someone else
+    pagemap_set(large->_mapStart, OBJ_SIZE(header), NULL, 0);
+    munmap(large->_mapStart, OBJ_SIZE(header));
 }
 
-extern void * realloc(void *ptr, size_t size)
+void * reallocLargeObject(ObjectHeader * header, size_t size)
 {
-    pthread_mutex_lock(&mutex);
-    increaseReallocCalls();
+    // An aligned object keeps its offset into the mapping, and with it
+    // its alignment within the page
+    LargeObject * large = LARGE_OF(header);
+    size_t offset = (char *)large - large->_mapStart;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t mapSize = (size + offset + sizeof(LargeObject) + pageSize - 1) & ~(pageSize - 1);
+    if (mapSize < size) {
+      return NULL;
+    }
 
-    // Allocate new object
-    void *newptr = allocateObject(size);
+    // The object may move, so it leaves the list while its neighbours'
+    // links still point at it
+    lock_counted(&largeMutex, LOCK_LARGE);
+    size_t oldSize = OBJ_SIZE(header);
+    large->_prev->_next = large->_next;
+    large->_next->_prev = large->_prev;
+
+    // The old pages leave the map before mremap lets them go. If the map
+    // cannot grow to cover the new ones, free leaves the object alone: a
+    // leak rather than a crash, and only once the OS is out of memory.
+    pagemap_set(large->_mapStart, oldSize, NULL, 0);
+    char * map = (char *)mremap(large->_mapStart, oldSize, mapSize, MREMAP_MAYMOVE);
+    LargeObject * moved;
+    if (map == MAP_FAILED) {
+      moved = large;
+      pagemap_set(large->_mapStart, oldSize, large, PAGE_LARGE);
+    } else {
+      moved = (LargeObject *)(map + offset);
+      moved->_mapStart = map;
+      moved->_objectSize = mapSize | OBJ_ALLOCATED | OBJ_MMAPPED;
+      _largeSize += mapSize - oldSize;
+      pagemap_set(map, mapSize, moved, PAGE_LARGE);
+    }
 
-    // Copy old object only if ptr != 0
-    if (ptr != 0) {
+    moved->_next = _largeList._next;
+    moved->_prev = &_largeList;
+    _largeList._next->_prev = moved;
+    _largeList._next = moved;
+    unlock_counted(&largeMutex, LOCK_LARGE);
 
-        // copy only the minimum number of bytes
-        ObjectHeader* hdr = (ObjectHeader *)((char *) ptr - sizeof(ObjectHeader));
-        size_t sizeToCopy =  hdr->_objectSize;
+    if (OBJ_SIZE(moved) != mapSize) {
+      return NULL;
+    }
+    return (void *)(moved + 1);
+}
+
+/*
+ * Coalesces an object with its free neighbours and puts the run in its bin.
+ */
+static void coalesceObject(ObjectHeader * centerHeader)
+{
+    size_t size = OBJ_SIZE(centerHeader);
+
+    // Check if right header is free, if so absorb it into center
+    ObjectHeader * rightHeader = (ObjectHeader *)((char *)centerHeader + size);
+    if (!(rightHeader->_objectSize & OBJ_ALLOCATED)) {
+      fl_remove(rightHeader);
+      size += OBJ_SIZE(rightHeader);
+    }
+
+    // Check if left header is free, if so absorb center into it. Its size is
+    // in the footer right before centerHeader.
+    if (!(centerHeader->_objectSize & OBJ_LEFT_ALLOCATED)) {
+      size_t leftSize = *(size_t *)((char *)centerHeader - HEADER_SIZE);
+      ObjectHeader * leftHeader = (ObjectHeader *)((char *)centerHeader - leftSize);
+      fl_remove(leftHeader);
+      size += leftSize;
+      centerHeader = leftHeader;
+    }
+
+    // The object has been written to, and anything it coalesces with is
+    // no longer known to be zero either. The left neighbour of a free
+    // object is always allocated, since free objects never touch.
+    centerHeader->_objectSize = size | OBJ_LEFT_ALLOCATED;
+    setFooter(centerHeader);
+
+    ObjectHeader * farRightHeader = (ObjectHeader *)((char *)centerHeader + size);
+    farRightHeader->_objectSize &= ~(size_t)OBJ_LEFT_ALLOCATED;
+
+    // The run is dirty as of now, whatever its parts were before
+    if (size >= DECAY_MIN_SIZE) {
+      DECAY_STAMP(centerHeader) = _decayEpoch;
+      if (_decayTime == 0)
+        decay_run(centerHeader);
+    }
+
+    fl_insert(centerHeader);
+
+    // If the whole 2MB chunk is free now, it may go back to the OS
+    if (size == WHOLE_CHUNK_SIZE) {
+      fl_release(centerHeader);
+    }
+    return;
+}
+
+/* 
+ * @param: pointer to the beginning of the block to be returned
+ * Note: ptr points to beginning of useable memory, not the block's header
+ */
+void freeObject(void *ptr)
+{
+    ObjectHeader * header = (ObjectHeader *)((char *)ptr - HEADER_SIZE);
+    size_t size = OBJ_SIZE(header);
+    if (!_deferCoalescing) {
+      coalesceObject(header);
+      return;
+    }
+
+    Arena * arena = CHUNK_OF(header)->_arena;
+    if (size < QUICK_LIMIT) {
+      quick_push(header);
+      return;
+    }
+
+    // A large object is freed in one piece, so the small ones around it
+    // are swept up now that they may coalesce with it
+    coalesceObject(header);
+    if (size >= QUICK_SWEEP_SIZE && arena->_quickCount) {
+      quick_sweep(arena);
+    }
+}
+
+/*
+ * Prints what each kind of lock cost, with the hold times of its buckets
+ * that are not empty.
+ */
+static void print_locks(MallocStats * stats)
+{
+    static const char *names[NUM_LOCK_KINDS] = { "arena", "slab", "grow", "large", "zone" };
+    int k, i;
+    for (k = 0; k < NUM_LOCK_KINDS; k++) {
+        LockStats * lock = &stats->_locks[k];
+        if (lock->_acquisitions == 0)
+            continue;
+        printf("%s lock:\t%lu taken, %lu contended, %.1f us waited, %.1f us held\n",
+               names[k], lock->_acquisitions, lock->_contended,
+               lock->_waitNanos / 1000.0, lock->_holdNanos / 1000.0);
+        printf("  held:");
+        for (i = 0; i < LOCK_HOLD_BUCKETS; i++) {
+            if (lock->_holds[i] == 0)
+                continue;
+            if (i < LOCK_HOLD_BUCKETS - 1)
+                printf(" <%luns:%lu", 1UL << (i + LOCK_HOLD_SHIFT), lock->_holds[i]);
+            else
+                printf(" >=%luns:%lu", 1UL << (i - 1 + LOCK_HOLD_SHIFT), lock->_holds[i]);
+        }
+        printf("\n");
+    }
+}
+
+/* 
+ * Prints the current state of the heap.
+ */
+void print()
+{
+    printf("\n-------------------\n");
+
+    MallocStats stats;
+    stats_get(&stats);
+
+    printf("HeapSize:\t%zd bytes\n", _heapSize );
+    printf("# mallocs:\t%lu\n", stats._mallocs );
+    printf("# reallocs:\t%lu\n", stats._reallocs );
+    printf("# callocs:\t%lu\n", stats._callocs );
+    printf("# frees:\t%lu\n", stats._frees );
+
+    // The rest would not match the references of the tests
+    if (_verbose > 1) {
+        _heapResident = residentBytes();
+        printf("Resident:\t%zd bytes\n", _heapResident );
+        printf("LargeSize:\t%zd bytes\n", _largeSize );
+        printf("SlabSize:\t%zd bytes\n", _slabSize );
+        printf("Purged:\t\t%zd bytes\n", _purgedSize );
+        printf("Live:\t\t%lu bytes\n", stats._liveBytes );
+        printf("# arenas:\t%d\n", stats._arenas );
+        printf("# in place:\t%lu (%.1f%%)\n", stats._reallocsInPlace,
+               stats._reallocs ? 100.0 * stats._reallocsInPlace / stats._reallocs : 0.0 );
+        printf("# contended:\t%lu\n", stats._lockContention );
+    }
+    if (_lockStats)
+        print_locks(&stats);
+
+    printf("\n-------------------\n");
+}
+
+static void stats_sum(MallocStats * total, MallocStats * counts)
+{
+    total->_mallocs += __atomic_load_n(&counts->_mallocs, __ATOMIC_RELAXED);
+    total->_frees += __atomic_load_n(&counts->_frees, __ATOMIC_RELAXED);
+    total->_reallocs += __atomic_load_n(&counts->_reallocs, __ATOMIC_RELAXED);
+    total->_reallocsInPlace += __atomic_load_n(&counts->_reallocsInPlace, __ATOMIC_RELAXED);
+    total->_callocs += __atomic_load_n(&counts->_callocs, __ATOMIC_RELAXED);
+    total->_bytesAllocated += __atomic_load_n(&counts->_bytesAllocated, __ATOMIC_RELAXED);
+    total->_bytesFreed += __atomic_load_n(&counts->_bytesFreed, __ATOMIC_RELAXED);
+    total->_lockContention += __atomic_load_n(&counts->_lockContention, __ATOMIC_RELAXED);
+    int i, k;
+    for (i = 0; i < STATS_SIZE_CLASSES; i++) {
+        total->_allocations[i] += __atomic_load_n(&counts->_allocations[i], __ATOMIC_RELAXED);
+        total->_deallocations[i] += __atomic_load_n(&counts->_deallocations[i], __ATOMIC_RELAXED);
+    }
+    for (k = 0; k < NUM_LOCK_KINDS; k++) {
+        LockStats * sum = &total->_locks[k];
+        LockStats * lock = &counts->_locks[k];
+        sum->_acquisitions += __atomic_load_n(&lock->_acquisitions, __ATOMIC_RELAXED);
+        sum->_contended += __atomic_load_n(&lock->_contended, __ATOMIC_RELAXED);
+        sum->_waitNanos += __atomic_load_n(&lock->_waitNanos, __ATOMIC_RELAXED);
+        sum->_holdNanos += __atomic_load_n(&lock->_holdNanos, __ATOMIC_RELAXED);
+        for (i = 0; i < LOCK_HOLD_BUCKETS; i++) {
+            sum->_holds[i] += __atomic_load_n(&lock->_holds[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Threads keep counting while their shards are summed up, so the result is
+ * a snapshot of each counter rather than of the heap as a whole.
+ */
+void stats_get(MallocStats * stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&statsMutex);
+    StatsShard * shard;
+    for (shard = _statsShards; shard != NULL; shard = shard->_next) {
+        stats_sum(stats, &shard->_counts);
+    }
+    pthread_mutex_unlock(&statsMutex);
+
+    stats->_liveBytes = stats->_bytesAllocated - stats->_bytesFreed;
+    stats->_arenas = _numArenas;
+    stats->_heapSize = __atomic_load_n(&_heapSize, __ATOMIC_RELAXED);
+    stats->_largeSize = __atomic_load_n(&_largeSize, __ATOMIC_RELAXED);
+    stats->_slabSize = __atomic_load_n(&_slabSize, __ATOMIC_RELAXED);
+    stats->_purgedSize = __atomic_load_n(&_purgedSize, __ATOMIC_RELAXED);
+}
+
+/*
+ * Prints the chunks of a tree in its order: by size, then address, or by
+ * address alone.
+ */
+static void print_tree(TreeChunk * node) {
+    if (node == NULL)
+        return;
+    print_tree(node->_left);
+    long offset = (long)node - (long)_memStart;
+    printf("[offset:%ld,size:%zd]->", offset, OBJ_SIZE(node));
+    print_tree(node->_right);
+}
+
+/* 
+ * Prints the current state of the free lists, smallest bin first.
+ * The calling thread's cache is flushed first so that its chunks show up.
+ */
+void print_list() {
+    tc_flush(&_threadCache);
+
+    printf("FreeList: ");
+    if (!_initialized) 
+        initialize();
+
+    int a, bin;
+    for (a = 0; a < _numArenas; a++) {
+        Arena * arena = &_arenas[a];
+        lock_arena(arena);
+        arena_drain(arena);
+        quick_sweep(arena);
+        for (bin = 0; bin < NUM_BINS; bin++) {
+            ObjectHeader * ptr = arena->_freeBins[bin]._listNext;
+
+            while (ptr != &arena->_freeBins[bin]) {
+                long offset = (long)ptr - (long)_memStart;
+                printf("[offset:%ld,size:%zd]->", offset, OBJ_SIZE(ptr));
+                ptr = ptr->_listNext;
+            }
+        }
+        print_tree(arena->_tree);
+        unlock_arena(arena);
+    }
+    printf("\n");
+}
+
+/* 
+ * This function employs the actual system call, mmap, that retrieves memory
+ * from the OS. The memory is aligned to arenaSize, so that a 2MB chunk
+ * never straddles two 2MB pages.
+ *
+ * @param: the chunk size that is requested from the OS
+ * @return: pointer to the beginning of the chunk retrieved from the OS,
+ *          or NULL if the OS is out of memory
+ */
+void * getMemoryFromOS(size_t size)
+{
+    // Use mmap() to get memory from OS. Map an extra arenaSize so that an
+    // aligned block fits, then unmap the slack on both sides.
+    char *_mapped = (char *)mmap(NULL, size + arenaSize, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_mapped == MAP_FAILED)
+        return NULL;
+
+    char *_mem = (char *)(((unsigned long)_mapped + arenaSize - 1) & ~((unsigned long)arenaSize - 1));
+    size_t head = _mem - _mapped;
+    if (head)
+        munmap(_mapped, head);
+    if (arenaSize - head)
+        munmap(_mem + size, arenaSize - head);
+
+    // The chunk is exactly one huge page, so the kernel can back it with one
+    if (_hugePages)
+        madvise(_mem, size, MADV_HUGEPAGE);
+
+    __atomic_fetch_add(&_heapSize, size, __ATOMIC_RELAXED);
+
+    // if the list hasn't been initialized, initialize memStart to mem
+    if (!_initialized)
+        _memStart = _mem;
+
+    return _mem;
+}
+
+/*
+ * Unmaps memory that came from getMemoryFromOS.
+ */
+void releaseMemoryToOS(void *mem, size_t size)
+{
+    munmap(mem, size);
+    __atomic_fetch_sub(&_heapSize, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Asks the kernel which pages of each arena's chunks, of each large
+ * object and of the slab zone are resident.
+ */
+size_t residentBytes()
+{
+    if (!_initialized)
+        return 0;
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    unsigned char vec[arenaSize / pageSize];
+    size_t resident = 0;
+
+    int a;
+    for (a = 0; a < _numArenas; a++) {
+        Arena * arena = &_arenas[a];
+        lock_arena(arena);
+        ArenaChunk * chunk = arena->_chunks._next;
+        while (chunk != &arena->_chunks) {
+            if (mincore(chunk, arenaSize, vec) == 0) {
+                int i;
+                for (i = 0; i < arenaSize / pageSize; i++) {
+                    if (vec[i] & 1)
+                        resident += pageSize;
+                }
+            }
+            chunk = chunk->_next;
+        }
+        unlock_arena(arena);
+    }
+
+    lock_counted(&largeMutex, LOCK_LARGE);
+    LargeObject * large = _largeList._next;
+    while (large != &_largeList) {
+        size_t pages = OBJ_SIZE(large) / pageSize;
+        unsigned char largeVec[4096];
+        size_t done = 0;
+        while (done < pages) {
+            size_t batch = pages - done < sizeof(largeVec) ? pages - done : sizeof(largeVec);
+            if (mincore(large->_mapStart + done * pageSize, batch * pageSize, largeVec) == 0) {
+                size_t i;
+                for (i = 0; i < batch; i++) {
+                    if (largeVec[i] & 1)
+                        resident += pageSize;
+                }
+            }
+            done += batch;
+        }
+        large = large->_next;
+    }
+    unlock_counted(&largeMutex, LOCK_LARGE);
+
+    lock_counted(&slabMutex, LOCK_ZONE);
+    char * slab;
+    for (slab = _slabZone; slab < _slabZoneTop; slab += SLAB_SIZE) {
+        if (mincore(slab, SLAB_SIZE, vec) == 0) {
+            int i;
+            for (i = 0; i < SLAB_SIZE / pageSize; i++) {
+                if (vec[i] & 1)
+                    resident += pageSize;
+            }
+        }
+    }
+    unlock_counted(&slabMutex, LOCK_ZONE);
+
+    return resident;
+}
+
+void atExitHandler()
+{
+    // Print statistics when exit
+    if (_verbose)
+        print();
+
+    // Leave a last heap profile behind
+    if (_profileInterval)
+        profile_dump(NULL);
+
+    // Other threads write their records when they exit
+    if (_traceFd >= 0)
+        trace_flush();
+}
+
+/*
+ * Allocates from a slab, from a mapping of its own or from the thread's
+ * arena, depending on size.
+ */
+static void * allocateMemory(size_t size)
+{
+    if (!_initialized)
+        initialize();
+
+    if (size >= _mmapThreshold || size > WHOLE_CHUNK_SIZE - HEADER_SIZE)
+        return allocateLargeObject(size, OBJECT_ALIGN);
+
+    // Slabs only need the lock of their size class
+    void *ptr = NULL;
+    if (_slabsEnabled && size <= SLAB_MAX_SIZE &&
+        slab_allocate(arena_get(), slab_class(size), &ptr, 1) == 1)
+        return ptr;
+
+    Arena * arena = arena_lock();
+    ptr = allocateObject(arena, size);
+    unlock_arena(arena);
+    return ptr;
+}
+
+/*
+ * Allocates size bytes at a multiple of alignment, a power of two. Slab
+ * slots start at a 64-byte boundary and follow each other at multiples of
+ * their size, so a slot whose size is a multiple of the alignment is
+ * aligned: small requests are served by the slab class of their size
+ * rounded up to the alignment. Anything else is carved out of the arena,
+ * or mapped when it would take a good part of a chunk.
+ */
+static void * allocateAlignedMemory(size_t alignment, size_t size)
+{
+    if (!_initialized)
+        initialize();
+
+    if (_slabsEnabled && alignment <= SLAB_DATA_ALIGN) {
+        size_t slotSize = ((size ? size : 1) + alignment - 1) & ~(alignment - 1);
+        if (slotSize >= size && slotSize <= SLAB_MAX_SIZE) {
+            void *ptr = tc_allocate(slotSize);
+            return ptr ? ptr : allocateMemory(slotSize);
+        }
+    }
+
+    // Arena objects and large objects are always 16-byte aligned
+    if (alignment <= OBJECT_ALIGN) {
+        void *ptr = tc_allocate(size);
+        return ptr ? ptr : allocateMemory(size);
+    }
+
+    if (size >= _mmapThreshold || size > WHOLE_CHUNK_SIZE / 2 || alignment > WHOLE_CHUNK_SIZE / 4)
+        return allocateLargeObject(size, alignment);
+
+    Arena * arena = arena_lock();
+    void *ptr = allocateAlignedObject(arena, alignment, size);
+    unlock_arena(arena);
+    return ptr;
+}
+
+/*
+ * Counts and profiles an aligned allocation like malloc does.
+ */
+static void * alignedMalloc(size_t alignment, size_t size)
+{
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_mallocs, 1);
+
+    void *ptr = allocateAlignedMemory(alignment, size);
+    if (ptr)
+        stats_allocated(counts, objectSize(ptr));
+    if (_profileInterval && ptr)
+        profile_allocated(ptr, size);
+    if (_traceFd >= 0 && ptr)
+        trace_record(TRACE_MEMALIGN, size, ptr, alignment);
+    return ptr;
+}
+
+/*
+ * Gives an object back to its slab, its arena, or to the OS if it has
+ * its own mapping.
+ */
+static void releaseMemory(void * ptr)
+{
+    unsigned long owner = pagemap_get(ptr);
+    if (PAGE_KIND(owner) == PAGE_SLAB) {
+        slab_free(ptr);
+        return;
+    }
+
+    ObjectHeader * header = (ObjectHeader *)((char *)ptr - HEADER_SIZE);
+    if (PAGE_KIND(owner) == PAGE_LARGE) {
+        freeLargeObject(header);
+        return;
+    }
+
+    Arena * arena = ((ArenaChunk *)PAGE_OWNER(owner))->_arena;
+
+    if (remote_free(arena, ptr))
+        return;
+    lock_arena(arena);
+    freeObject(ptr);
+    unlock_arena(arena);
+
+    // The decay thread does not survive fork
+    if (!_decayStarted)
+        decay_start();
+}
+
+/*
+ * C interface
+ */
+
+extern void * malloc(size_t size)
+{
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_mallocs, 1);
+
+    void *ptr = tc_allocate(size);
+    if (ptr == NULL)
+        ptr = allocateMemory(size);
+
+    if (ptr)
+        stats_allocated(counts, objectSize(ptr));
+    if (_profileInterval && ptr)
+        profile_allocated(ptr, size);
+    if (_traceFd >= 0 && ptr)
+        trace_record(TRACE_MALLOC, size, ptr, 0);
+    return ptr;
+}
+
+extern void free(void *ptr)
+{
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_frees, 1);
+
+    if (ptr == 0) {
+        // No object to free
+        return;
+    }
+    if (pagemap_get(ptr) == 0) {
+        // Not one of ours, so its header cannot be trusted
+        return;
+    }
+
+    stats_freed(counts, objectSize(ptr));
+    if (_profileTable)
+        profile_freed(ptr);
+    if (_traceFd >= 0)
+        trace_record(TRACE_FREE, 0, ptr, 0);
+
+    if (tc_free(ptr))
+        return;
+
+    // The object goes back to where it came from
+    releaseMemory(ptr);
+}
+
+extern void * realloc(void *ptr, size_t size)
+{
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_reallocs, 1);
+
+    ObjectHeader* hdr = NULL;
+    size_t oldSize = 0;
+    if (ptr != 0 && pagemap_get(ptr) == 0) {
+        // Not one of ours: there is no telling how much of it to copy
+        errno = EINVAL;
+        return NULL;
+    }
+    if (ptr != 0 && is_slab(ptr)) {
+        // A slab object can only stay put if the new size fits its slot
+        oldSize = SLAB_OF(ptr)->_objectSize;
+        if (size <= oldSize) {
+            STAT_ADD(counts->_reallocsInPlace, 1);
+            if (_traceFd >= 0)
+                trace_record(TRACE_REALLOC, size, ptr, (unsigned long)ptr);
+            return ptr;
+        }
+    } else if (ptr != 0) {
+        hdr = (ObjectHeader *)((char *) ptr - HEADER_SIZE);
+        oldSize = objectSize(ptr);
+
+        // A large object that stays large is resized by the kernel
+        Arena * arena = arena_of(hdr);
+        if (arena == NULL && size >= _mmapThreshold) {
+            void *newptr = reallocLargeObject(hdr, size);
+            if (newptr) {
+                STAT_ADD(counts->_reallocsInPlace, 1);
+                stats_freed(counts, oldSize);
+                stats_allocated(counts, objectSize(newptr));
+                if (_profileTable)
+                    profile_freed(ptr);
+                if (_profileInterval)
+                    profile_allocated(newptr, size);
+                if (_traceFd >= 0)
+                    trace_record(TRACE_REALLOC, size, newptr, (unsigned long)ptr);
+                return newptr;
+            }
+        }
+
+        // An object that stays in its arena is resized there if possible
+        if (arena != NULL && size < _mmapThreshold) {
+            lock_arena(arena);
+            int resized = reallocObject(hdr, size);
+            unlock_arena(arena);
+            if (resized) {
+                STAT_ADD(counts->_reallocsInPlace, 1);
+                stats_freed(counts, oldSize);
+                stats_allocated(counts, objectSize(ptr));
+                if (_profileTable)
+                    profile_freed(ptr);
+                if (_profileInterval)
+                    profile_allocated(ptr, size);
+                if (_traceFd >= 0)
+                    trace_record(TRACE_REALLOC, size, ptr, (unsigned long)ptr);
+                return ptr;
+            }
+        }
+    }
+
+    // Allocate new object. On failure the old object is left alone
+    void *newptr = allocateMemory(size);
+    if (newptr == NULL)
+        return NULL;
+    stats_allocated(counts, objectSize(newptr));
+    if (_profileInterval)
+        profile_allocated(newptr, size);
+    if (_traceFd >= 0)
+        trace_record(TRACE_REALLOC, size, newptr, (unsigned long)ptr);
+
+    // Copy old object only if ptr != 0
+    if (ptr != 0) {
+        stats_freed(counts, oldSize);
+        if (_profileTable)
+            profile_freed(ptr);
+
+        // copy only the minimum number of bytes
+        size_t sizeToCopy =  oldSize;
         if (sizeToCopy > size)
             sizeToCopy = size;
 
         memcpy(newptr, ptr, sizeToCopy);
 
-        //Free old object
-        freeObject(ptr);
+        //Free old object where it came from
+        releaseMemory(ptr);
     }
 
     return newptr;
@@ -306,101 +1677,1954 @@ extern void * realloc(void *ptr, size_t size)
 
 extern void * calloc(size_t nelem, size_t elsize)
 {
-    pthread_mutex_lock(&mutex);
-    increaseCallocCalls();
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_callocs, 1);
 
     // calloc allocates and initializes
+    if (elsize && nelem > (size_t)-1 / elsize) {
+        // nelem * elsize does not fit in a size_t
+        errno = ENOMEM;
+        return NULL;
+    }
     size_t size = nelem *elsize;
 
-    void *ptr = allocateObject(size);
+    void *ptr = allocateMemory(size);
+    if (ptr)
+        stats_allocated(counts, objectSize(ptr));
+    if (_profileInterval && ptr)
+        profile_allocated(ptr, size);
+    if (_traceFd >= 0 && ptr)
+        trace_record(TRACE_CALLOC, size, ptr, 0);
 
-    if (ptr) {
-        // No error; initialize chunk with 0s
+    if (ptr && is_slab(ptr)) {
+        // No error; slab slots are small enough to always clear
         memset(ptr, 0, size);
+    } else if (ptr) {
+        // No error; initialize chunk with 0s unless it is fresh from the OS
+        ObjectHeader * hdr = (ObjectHeader *)((char *)ptr - HEADER_SIZE);
+        if (!(hdr->_objectSize & OBJ_ZEROED))
+            memset(ptr, 0, size);
+        hdr->_objectSize &= ~(size_t)OBJ_ZEROED;
     }
 
     return ptr;
 }
 
-// Auxilary functions for allocateObject(..)
-ObjectHeader * fl_search(size_t size) {
-  ObjectHeader * curr = _freeList->_listNext;
-  while (curr != &_freeListSentinel) {
-    if (curr->_objectSize >= size) {
-      return curr;
-    }
-    curr = curr->_listNext;
-  }
-  return NULL;
-}
+/*
+ * Allocates count objects of size bytes into ptrs, taking the arena lock
+ * once. Returns how many were allocated; fewer than count means the OS is
+ * out of memory.
+ */
+extern size_t malloc_batch(size_t size, size_t count, void **ptrs)
+{
+    MallocStats * counts = stats_shard();
 
-ObjectHeader * fl_create() {
-  // Get memory from OS
-  void *_mem = getMemoryFromOS(arenaSize);
+    if (!_initialized)
+        initialize();
 
-  // Write fenceposts
-  ObjectHeader * fencePostHead = (ObjectHeader *)_mem;
-  fencePostHead->_allocated = 1;
-  fencePostHead->_objectSize = 0;
+    size_t done = 0;
+    if (size >= _mmapThreshold || size > WHOLE_CHUNK_SIZE - HEADER_SIZE) {
+        for (; done < count; done++) {
+            ptrs[done] = allocateLargeObject(size, OBJECT_ALIGN);
+            if (ptrs[done] == NULL)
+                break;
+        }
+    } else {
+        if (_slabsEnabled && size <= SLAB_MAX_SIZE) {
+            // slab_allocate counts slots in an int
+            while (done < count) {
+                int want = count - done < INT_MAX ? (int)(count - done) : INT_MAX;
+                int taken = slab_allocate(arena_get(), slab_class(size), ptrs + done, want);
+                done += taken;
+                if (taken < want)
+                    break;
+            }
+        }
+        if (done < count) {
+            Arena * arena = arena_lock();
+            done += allocateObjects(arena, size, count - done, ptrs + done);
+            unlock_arena(arena);
+        }
+    }
 
-  char * temp = (char *)_mem + arenaSize - sizeof(ObjectHeader);
-  ObjectHeader * fencePostTail = (ObjectHeader *)temp;
-  fencePostTail->_allocated = 1;
-  fencePostTail->_objectSize = 0;
+    // Only the objects handed out count as calls
+    STAT_ADD(counts->_mallocs, done);
+    size_t i;
+    for (i = 0; i < done; i++) {
+        stats_allocated(counts, objectSize(ptrs[i]));
+        if (_profileInterval)
+            profile_allocated(ptrs[i], size);
+        if (_traceFd >= 0)
+            trace_record(TRACE_MALLOC, size, ptrs[i], 0);
+    }
+    return done;
+}
 
-  // Write header
-  temp = (char *)_mem + sizeof(ObjectHeader);
-  ObjectHeader *currentHeader = (ObjectHeader *)temp;
-  currentHeader->_objectSize = arenaSize - (2*sizeof(ObjectHeader));
-  currentHeader->_leftObjectSize = 0;
-  currentHeader->_allocated = 0;
-  
-  // Insert into beginning of freelist
-  currentHeader->_listNext = _freeList->_listNext;
-  currentHeader->_listPrev = _freeList;
-  _freeList->_listNext = currentHeader;
-  
-  return currentHeader;
+static int compareAddresses(const void * a, const void * b)
+{
+    char * x = *(char **)a;
+    char * y = *(char **)b;
+    return x < y ? -1 : x > y;
 }
 
-ObjectHeader * split_chunk(ObjectHeader * header, size_t size) {
-  // Calculate position of next header
-  size_t leftoverMem = header->_objectSize - size;
+/*
+ * Frees count objects. The array is sorted by address, so that the objects
+ * of an arena are freed under one lock and a run of neighbouring objects is
+ * merged into one object and freed at once.
+ */
+extern void free_batch(void **ptrs, size_t count)
+{
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_frees, count);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (ptrs[i] == 0)
+            continue;
+        if (pagemap_get(ptrs[i]) == 0) {
+            // Not one of ours, so it is left alone
+            ptrs[i] = 0;
+            continue;
+        }
+        stats_freed(counts, objectSize(ptrs[i]));
+        if (_profileTable)
+            profile_freed(ptrs[i]);
+        if (_traceFd >= 0)
+            trace_record(TRACE_FREE, 0, ptrs[i], 0);
+    }
 
-  // Write fields to new header
-  ObjectHeader * newHeader = (ObjectHeader *)((char *)header + leftoverMem);
-  newHeader->_objectSize = size;
-  newHeader->_leftObjectSize = leftoverMem;
-  newHeader->_allocated = 0;
-  newHeader->_listNext = NULL;
-  newHeader->_listPrev = NULL;
+    qsort(ptrs, count, sizeof(void *), compareAddresses);
+
+    // Slab and large objects take locks that are never taken under an
+    // arena's, so the arena is let go first. Sorting keeps the zone's slab
+    // objects together.
+    Arena * locked = NULL;
+    for (i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == 0)
+            continue;
+
+        ObjectHeader * header = (ObjectHeader *)((char *)ptr - HEADER_SIZE);
+        Arena * arena = is_slab(ptr) ? NULL : arena_of(header);
+        if (arena == NULL && locked) {
+            unlock_arena(locked);
+            locked = NULL;
+        }
+
+        if (is_slab(ptr)) {
+            slab_free(ptr);
+            continue;
+        }
+
+        if (arena == NULL) {
+            freeLargeObject(header);
+            continue;
+        }
+
+        if (arena != locked) {
+            if (locked)
+                unlock_arena(locked);
+            lock_arena(arena);
+            locked = arena;
+        }
+
+        // Absorb the objects that follow this one in the same chunk
+        size_t run = OBJ_SIZE(header);
+        while (i + 1 < count && (char *)ptrs[i + 1] == (char *)ptr + run &&
+               CHUNK_OF(ptrs[i + 1]) == CHUNK_OF(header)) {
+            run += OBJ_SIZE((ObjectHeader *)((char *)ptrs[i + 1] - HEADER_SIZE));
+            i++;
+        }
+        header->_objectSize = run | (header->_objectSize & OBJ_FLAGS);
+        freeObject(ptr);
+    }
+    if (locked)
+        unlock_arena(locked);
+}
 
-  // Update the header to the left
-  header->_objectSize = leftoverMem;
-  
-  // Update the header to the right (if it's not a dummy header)
-  ObjectHeader * rightHeader = (ObjectHeader *)((char *)newHeader + newHeader->_objectSize);
-  if (rightHeader->_objectSize) {
-    rightHeader->_leftObjectSize = newHeader->_objectSize;
-  }
+extern int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    // The alignment must be a power of two and a multiple of sizeof(void *)
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+
+    void *ptr = alignedMalloc(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
 
-  return newHeader;
+extern void * aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return alignedMalloc(alignment, size);
 }
 
-void fl_remove(ObjectHeader * header) {
-  // Check to see if the chunk is actually in the freelist
-  if (header->_listPrev == NULL || header->_listNext == NULL) {
-    return;
-  }
-  header->_listPrev->_listNext = header->_listNext;
-  header->_listNext->_listPrev = header->_listPrev;
-  header->_listPrev = NULL;
-  header->_listNext = NULL;
+extern void * memalign(size_t alignment, size_t size)
+{
+    // Like glibc, other alignments are rounded up to a power of two
+    if (alignment > ((size_t)-1 >> 1) + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t powerOfTwo = 1;
+    while (powerOfTwo < alignment)
+        powerOfTwo <<= 1;
+    return alignedMalloc(powerOfTwo, size);
 }
 
-void fl_insert(ObjectHeader * header) {
-  _freeList->_listNext->_listPrev = header;
-  header->_listNext = _freeList->_listNext;
-  header->_listPrev = _freeList;
-  _freeList->_listNext = header;
+extern void * valloc(size_t size)
+{
+    return alignedMalloc(sysconf(_SC_PAGESIZE), size);
+}
+
+extern void * pvalloc(size_t size)
+{
+    // The size is rounded up to whole pages, and is at least one page
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + pageSize - 1) & ~(pageSize - 1);
+    if (rounded < size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return alignedMalloc(pageSize, rounded ? rounded : pageSize);
+}
+
+extern void * reallocarray(void *ptr, size_t nelem, size_t elsize)
+{
+    if (elsize && nelem > (size_t)-1 / elsize) {
+        // nelem * elsize does not fit in a size_t
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nelem * elsize);
+}
+
+extern size_t malloc_usable_size(void *ptr)
+{
+    // Like glibc, 0 for null, and for pointers that are not the heap's
+    if (ptr == 0 || pagemap_get(ptr) == 0)
+        return 0;
+    return objectSize(ptr);
+}
+
+/*
+ * Frees an object that operator new allocated for size bytes at alignment,
+ * 0 for the default. A slab object's size class follows from the two, so
+ * neither the page map nor its slab is looked at. realloc can leave an
+ * object in a larger slot than its size asks for, which is why C's free
+ * never takes this path.
+ */
+void sizedFree(void *ptr, size_t size, size_t alignment)
+{
+    // The same slot size that allocateAlignedMemory picks
+    size_t slotSize = size;
+    if (alignment)
+        slotSize = ((size ? size : 1) + alignment - 1) & ~(alignment - 1);
+    if (ptr == 0 || alignment > SLAB_DATA_ALIGN || slotSize < size || slotSize > SLAB_MAX_SIZE ||
+        !is_slab(ptr)) {
+        free(ptr);
+        return;
+    }
+
+    MallocStats * counts = stats_shard();
+    STAT_ADD(counts->_frees, 1);
+
+    int slabClass = slab_class(slotSize);
+    stats_freed(counts, slab_size(slabClass));
+    if (_profileTable)
+        profile_freed(ptr);
+    if (_traceFd >= 0)
+        trace_record(TRACE_FREE, 0, ptr, 0);
+
+    tc_free_slab(ptr, slabClass);
+}
+
+/*
+ * C++ operators new and delete, under their mangled names so that this
+ * file stays C. Failed allocations call the new handler and try again like
+ * libstdc++'s do, and throw std::bad_alloc once there is none. Both come
+ * from libstdc++, which every program that calls these has loaded. The
+ * nothrow versions return null at once instead: the handler may throw, and
+ * C cannot catch it for them.
+ */
+typedef void (*NewHandler)();
+extern NewHandler getNewHandler() __asm__("_ZSt15get_new_handlerv") __attribute__((weak));
+extern void throwBadAlloc() __asm__("_ZSt17__throw_bad_allocv") __attribute__((weak, noreturn));
+
+static void * newMemory(size_t size, size_t alignment, int nothrow)
+{
+    for (;;) {
+        void *ptr = alignment ? alignedMalloc(alignment, size) : malloc(size);
+        if (ptr || nothrow)
+            return ptr;
+
+        NewHandler handler = getNewHandler ? getNewHandler() : NULL;
+        if (handler == NULL) {
+            if (throwBadAlloc)
+                throwBadAlloc();
+            return NULL;
+        }
+        handler();
+    }
+}
+
+extern void * operatorNew(size_t size) __asm__("_Znwm");
+extern void * operatorNew(size_t size) { return newMemory(size, 0, 0); }
+extern void * operatorNewArray(size_t size) __asm__("_Znam");
+extern void * operatorNewArray(size_t size) { return newMemory(size, 0, 0); }
+extern void * operatorNewNothrow(size_t size, const void *tag) __asm__("_ZnwmRKSt9nothrow_t");
+extern void * operatorNewNothrow(size_t size, const void *tag) { return newMemory(size, 0, 1); }
+extern void * operatorNewArrayNothrow(size_t size, const void *tag) __asm__("_ZnamRKSt9nothrow_t");
+extern void * operatorNewArrayNothrow(size_t size, const void *tag) { return newMemory(size, 0, 1); }
+extern void * operatorNewAligned(size_t size, size_t alignment) __asm__("_ZnwmSt11align_val_t");
+extern void * operatorNewAligned(size_t size, size_t alignment) { return newMemory(size, alignment, 0); }
+extern void * operatorNewArrayAligned(size_t size, size_t alignment) __asm__("_ZnamSt11align_val_t");
+extern void * operatorNewArrayAligned(size_t size, size_t alignment) { return newMemory(size, alignment, 0); }
+extern void * operatorNewAlignedNothrow(size_t size, size_t alignment, const void *tag)
+    __asm__("_ZnwmSt11align_val_tRKSt9nothrow_t");
+extern void * operatorNewAlignedNothrow(size_t size, size_t alignment, const void *tag)
+{ return newMemory(size, alignment, 1); }
+extern void * operatorNewArrayAlignedNothrow(size_t size, size_t alignment, const void *tag)
+    __asm__("_ZnamSt11align_val_tRKSt9nothrow_t");
+extern void * operatorNewArrayAlignedNothrow(size_t size, size_t alignment, const void *tag)
+{ return newMemory(size, alignment, 1); }
+
+extern void operatorDelete(void *ptr) __asm__("_ZdlPv");
+extern void operatorDelete(void *ptr) { free(ptr); }
+extern void operatorDeleteArray(void *ptr) __asm__("_ZdaPv");
+extern void operatorDeleteArray(void *ptr) { free(ptr); }
+extern void operatorDeleteNothrow(void *ptr, const void *tag) __asm__("_ZdlPvRKSt9nothrow_t");
+extern void operatorDeleteNothrow(void *ptr, const void *tag) { free(ptr); }
+extern void operatorDeleteArrayNothrow(void *ptr, const void *tag) __asm__("_ZdaPvRKSt9nothrow_t");
+extern void operatorDeleteArrayNothrow(void *ptr, const void *tag) { free(ptr); }
+extern void operatorDeleteSized(void *ptr, size_t size) __asm__("_ZdlPvm");
+extern void operatorDeleteSized(void *ptr, size_t size) { sizedFree(ptr, size, 0); }
+extern void operatorDeleteArraySized(void *ptr, size_t size) __asm__("_ZdaPvm");
+extern void operatorDeleteArraySized(void *ptr, size_t size) { sizedFree(ptr, size, 0); }
+extern void operatorDeleteAligned(void *ptr, size_t alignment) __asm__("_ZdlPvSt11align_val_t");
+extern void operatorDeleteAligned(void *ptr, size_t alignment) { free(ptr); }
+extern void operatorDeleteArrayAligned(void *ptr, size_t alignment) __asm__("_ZdaPvSt11align_val_t");
+extern void operatorDeleteArrayAligned(void *ptr, size_t alignment) { free(ptr); }
+extern void operatorDeleteSizedAligned(void *ptr, size_t size, size_t alignment) __asm__("_ZdlPvmSt11align_val_t");
+extern void operatorDeleteSizedAligned(void *ptr, size_t size, size_t alignment) { sizedFree(ptr, size, alignment); }
+extern void operatorDeleteArraySizedAligned(void *ptr, size_t size, size_t alignment) __asm__("_ZdaPvmSt11align_val_t");
+extern void operatorDeleteArraySizedAligned(void *ptr, size_t size, size_t alignment) { sizedFree(ptr, size, alignment); }
+extern void operatorDeleteAlignedNothrow(void *ptr, size_t alignment, const void *tag)
+    __asm__("_ZdlPvSt11align_val_tRKSt9nothrow_t");
+extern void operatorDeleteAlignedNothrow(void *ptr, size_t alignment, const void *tag) { free(ptr); }
+extern void operatorDeleteArrayAlignedNothrow(void *ptr, size_t alignment, const void *tag)
+    __asm__("_ZdaPvSt11align_val_tRKSt9nothrow_t");
+extern void operatorDeleteArrayAlignedNothrow(void *ptr, size_t alignment, const void *tag) { free(ptr); }
+
+// Auxilary functions for allocateObject(..)
+int fl_bin(size_t size) {
+  if (size < SMALL_BIN_LIMIT) {
+    // One exact bin per multiple of 16
+    return size >> 4;
+  }
+
+  // Geometric bins: the power of two picks a group of BIN_SUBDIVISIONS bins,
+  // the next two bits below the leading one pick the bin inside the group
+  int log2 = 63 - __builtin_clzl(size);
+  int sub = (size >> (log2 - 2)) & (BIN_SUBDIVISIONS - 1);
+  int bin = NUM_SMALL_BINS + (log2 - 9) * BIN_SUBDIVISIONS + sub;
+  return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+/*
+ * Returns the first non-empty bin at or above bin, or -1 if there is none.
+ */
+static int fl_next_bin(Arena * arena, int bin) {
+  int word = bin >> 6;
+  unsigned long bits = arena->_binMap[word] & (~0UL << (bin & 63));
+  while (!bits) {
+    if (++word == BINMAP_WORDS)
+      return -1;
+    bits = arena->_binMap[word];
+  }
+  return (word << 6) + __builtin_ctzl(bits);
+}
+
+// Red-black tree of large free chunks, ordered by size and then address,
+// or by address alone
+
+static int tree_less(TreeChunk * a, TreeChunk * b) {
+  if (_addressOrder) {
+    return a < b;
+  }
+  return OBJ_SIZE(a) < OBJ_SIZE(b) || (OBJ_SIZE(a) == OBJ_SIZE(b) && a < b);
+}
+
+/*
+ * Recomputes the largest chunk of a subtree from its children's.
+ */
+static void tree_update(TreeChunk * node) {
+  size_t max = OBJ_SIZE(node);
+  if (node->_left && node->_left->_maxSize > max) {
+    max = node->_left->_maxSize;
+  }
+  if (node->_right && node->_right->_maxSize > max) {
+    max = node->_right->_maxSize;
+  }
+  node->_maxSize = max;
+}
+
+/*
+ * Recomputes the largest chunks from node up to the root, after the
+ * chunks below node have changed.
+ */
+static void tree_update_path(TreeChunk * node) {
+  if (!_addressOrder) {
+    return;
+  }
+  for (; node != NULL; node = node->_parent) {
+    tree_update(node);
+  }
+}
+
+/*
+ * Puts v where u hangs in the tree. v may be null.
+ */
+static void tree_replace(Arena * arena, TreeChunk * u, TreeChunk * v) {
+  if (u->_parent == NULL) {
+    arena->_tree = v;
+  } else if (u == u->_parent->_left) {
+    u->_parent->_left = v;
+  } else {
+    u->_parent->_right = v;
+  }
+  if (v) {
+    v->_parent = u->_parent;
+  }
+}
+
+static void tree_rotate_left(Arena * arena, TreeChunk * x) {
+  TreeChunk * y = x->_right;
+  x->_right = y->_left;
+  if (y->_left) {
+    y->_left->_parent = x;
+  }
+  tree_replace(arena, x, y);
+  y->_left = x;
+  x->_parent = y;
+  if (_addressOrder) {
+    tree_update(x);
+    tree_update(y);
+  }
+}
+
+static void tree_rotate_right(Arena * arena, TreeChunk * x) {
+  TreeChunk * y = x->_left;
+  x->_left = y->_right;
+  if (y->_right) {
+    y->_right->_parent = x;
+  }
+  tree_replace(arena, x, y);
+  y->_right = x;
+  x->_parent = y;
+  if (_addressOrder) {
+    tree_update(x);
+    tree_update(y);
+  }
+}
+
+static void tree_insert(Arena * arena, TreeChunk * node) {
+  TreeChunk * parent = NULL;
+  TreeChunk * curr = arena->_tree;
+  while (curr) {
+    parent = curr;
+    curr = tree_less(node, curr) ? curr->_left : curr->_right;
+  }
+
+  node->_parent = parent;
+  node->_left = NULL;
+  node->_right = NULL;
+  node->_red = 1;
+  if (parent == NULL) {
+    arena->_tree = node;
+  } else if (tree_less(node, parent)) {
+    parent->_left = node;
+  } else {
+    parent->_right = node;
+  }
+  node->_maxSize = OBJ_SIZE(node);
+  tree_update_path(parent);
+
+  // Restore the colouring: no red node has a red parent
+  while (node->_parent && node->_parent->_red) {
+    TreeChunk * p = node->_parent;
+    TreeChunk * g = p->_parent;
+    if (p == g->_left) {
+      TreeChunk * uncle = g->_right;
+      if (uncle && uncle->_red) {
+        p->_red = 0;
+        uncle->_red = 0;
+        g->_red = 1;
+        node = g;
+      } else {
+        if (node == p->_right) {
+          node = p;
+          tree_rotate_left(arena, node);
+          p = node->_parent;
+        }
+        p->_red = 0;
+        g->_red = 1;
+        tree_rotate_right(arena, g);
+      }
+    } else {
+      TreeChunk * uncle = g->_left;
+      if (uncle && uncle->_red) {
+        p->_red = 0;
+        uncle->_red = 0;
+        g->_red = 1;
+        node = g;
+      } else {
+        if (node == p->_left) {
+          node = p;
+          tree_rotate_right(arena, node);
+          p = node->_parent;
+        }
+        p->_red = 0;
+        g->_red = 1;
+        tree_rotate_left(arena, g);
+      }
+    }
+  }
+  arena->_tree->_red = 0;
+}
+
+static void tree_remove(Arena * arena, TreeChunk * node) {
+  TreeChunk * x;
+  TreeChunk * xParent;
+  int removedRed = node->_red;
+
+  if (node->_left == NULL) {
+    x = node->_right;
+    xParent = node->_parent;
+    tree_replace(arena, node, x);
+  } else if (node->_right == NULL) {
+    x = node->_left;
+    xParent = node->_parent;
+    tree_replace(arena, node, x);
+  } else {
+    // The successor takes the node's place and colour
+    TreeChunk * succ = node->_right;
+    while (succ->_left) {
+      succ = succ->_left;
+    }
+    removedRed = succ->_red;
+    x = succ->_right;
+    if (succ->_parent == node) {
+      xParent = succ;
+    } else {
+      xParent = succ->_parent;
+      tree_replace(arena, succ, x);
+      succ->_right = node->_right;
+      succ->_right->_parent = succ;
+    }
+    tree_replace(arena, node, succ);
+    succ->_left = node->_left;
+    succ->_left->_parent = succ;
+    succ->_red = node->_red;
+  }
+
+  // Everything below xParent is in place; rotations keep it that way
+  tree_update_path(xParent);
+
+  if (removedRed) {
+    return;
+  }
+
+  // A black node left the path through x; push the missing black up
+  while (x != arena->_tree && (x == NULL || !x->_red)) {
+    if (x == xParent->_left) {
+      TreeChunk * w = xParent->_right;
+      if (w->_red) {
+        w->_red = 0;
+        xParent->_red = 1;
+        tree_rotate_left(arena, xParent);
+        w = xParent->_right;
+      }
+      if ((w->_left == NULL || !w->_left->_red) && (w->_right == NULL || !w->_right->_red)) {
+        w->_red = 1;
+        x = xParent;
+        xParent = x->_parent;
+      } else {
+        if (w->_right == NULL || !w->_right->_red) {
+          w->_left->_red = 0;
+          w->_red = 1;
+          tree_rotate_right(arena, w);
+          w = xParent->_right;
+        }
+        w->_red = xParent->_red;
+        xParent->_red = 0;
+        w->_right->_red = 0;
+        tree_rotate_left(arena, xParent);
+        x = arena->_tree;
+      }
+    } else {
+      TreeChunk * w = xParent->_left;
+      if (w->_red) {
+        w->_red = 0;
+        xParent->_red = 1;
+        tree_rotate_right(arena, xParent);
+        w = xParent->_left;
+      }
+      if ((w->_left == NULL || !w->_left->_red) && (w->_right == NULL || !w->_right->_red)) {
+        w->_red = 1;
+        x = xParent;
+        xParent = x->_parent;
+      } else {
+        if (w->_left == NULL || !w->_left->_red) {
+          w->_right->_red = 0;
+          w->_red = 1;
+          tree_rotate_left(arena, w);
+          w = xParent->_left;
+        }
+        w->_red = xParent->_red;
+        xParent->_red = 0;
+        w->_left->_red = 0;
+        tree_rotate_right(arena, xParent);
+        x = arena->_tree;
+      }
+    }
+  }
+  if (x) {
+    x->_red = 0;
+  }
+}
+
+/*
+ * Returns the smallest chunk of at least size bytes, the lowest one of
+ * several of that size, or null if no chunk is big enough.
+ */
+static TreeChunk * tree_best_fit(Arena * arena, size_t size) {
+  TreeChunk * best = NULL;
+  TreeChunk * curr = arena->_tree;
+  while (curr) {
+    if (OBJ_SIZE(curr) >= size) {
+      best = curr;
+      curr = curr->_left;
+    } else {
+      curr = curr->_right;
+    }
+  }
+  return best;
+}
+
+/*
+ * Returns the lowest chunk of at least size bytes from a tree in address
+ * order, or null if no chunk is big enough.
+ */
+static TreeChunk * tree_first_fit(Arena * arena, size_t size) {
+  TreeChunk * curr = arena->_tree;
+  if (curr == NULL || curr->_maxSize < size) {
+    return NULL;
+  }
+  for (;;) {
+    if (curr->_left && curr->_left->_maxSize >= size) {
+      curr = curr->_left;
+    } else if (OBJ_SIZE(curr) >= size) {
+      return curr;
+    } else {
+      curr = curr->_right;
+    }
+  }
+}
+
+ObjectHeader * fl_search(Arena * arena, size_t size) {
+  if (_bestFit) {
+    // Small bins are exact, so the first non-empty one is the best fit.
+    // Only small bins are ever non-empty with best fit.
+    if (size < SMALL_BIN_LIMIT) {
+      int bin = fl_next_bin(arena, fl_bin(size));
+      if (bin >= 0) {
+        return arena->_freeBins[bin]._listNext;
+      }
+    }
+    if (_addressOrder) {
+      return (ObjectHeader *)tree_first_fit(arena, size);
+    }
+    return (ObjectHeader *)tree_best_fit(arena, size);
+  }
+
+  // Round the size up to the next bin boundary, so that every chunk in the
+  // bin we start from is guaranteed to fit. Small bins are exact already.
+  size_t searchSize = size;
+  if (size >= SMALL_BIN_LIMIT) {
+    int log2 = 63 - __builtin_clzl(size);
+    searchSize += ((size_t)1 << (log2 - 2)) - 1;
+  }
+
+  int bin = fl_next_bin(arena, fl_bin(searchSize));
+  if (bin >= 0) {
+    return arena->_freeBins[bin]._listNext;
+  }
+
+  // Before asking the OS for more memory, check the chunks that share a bin
+  // with the request; some of them may still be big enough.
+  bin = fl_bin(size);
+  ObjectHeader * curr = arena->_freeBins[bin]._listNext;
+  while (curr != &arena->_freeBins[bin]) {
+    if (OBJ_SIZE(curr) >= size) {
+      return curr;
+    }
+    curr = curr->_listNext;
+  }
+  return NULL;
+}
+
+ObjectHeader * fl_create(Arena * arena, size_t size) {
+  // Get memory from OS. Once the heap is up, the arena's lock is dropped
+  // while the chunk is mapped, so that threads can go on freeing into the
+  // arena. The growth lock is always taken before the arena's lock, and
+  // lets only one thread at a time grow the arena. Whoever comes next
+  // looks again, since the arena may have grown meanwhile.
+  void *_mem;
+  if (_initialized) {
+    unlock_arena(arena);
+    lock_counted(&arena->_growLock, LOCK_GROW);
+    lock_arena(arena);
+    ObjectHeader * grown = fl_search(arena, size);
+    if (grown != NULL) {
+      unlock_counted(&arena->_growLock, LOCK_GROW);
+      return grown;
+    }
+
+    unlock_arena(arena);
+    _mem = getMemoryFromOS(arenaSize);
+    lock_arena(arena);
+    unlock_counted(&arena->_growLock, LOCK_GROW);
+  } else {
+    _mem = getMemoryFromOS(arenaSize);
+  }
+  if (_mem == NULL) {
+    return NULL;
+  }
+  if (!pagemap_set(_mem, arenaSize, _mem, PAGE_ARENA)) {
+    releaseMemoryToOS(_mem, arenaSize);
+    return NULL;
+  }
+
+  // Link the chunk into the arena's list of chunks and write the fenceposts.
+  // The head fencepost is the last word of the ArenaChunk.
+  ArenaChunk * chunk = (ArenaChunk *)_mem;
+  chunk->_arena = arena;
+  chunk->_next = arena->_chunks._next;
+  chunk->_prev = &arena->_chunks;
+  arena->_chunks._next->_prev = chunk;
+  arena->_chunks._next = chunk;
+  chunk->_fencePost = OBJ_ALLOCATED | OBJ_LEFT_ALLOCATED;
+
+  ObjectHeader * fencePostTail = (ObjectHeader *)((char *)_mem + arenaSize - HEADER_SIZE);
+  fencePostTail->_objectSize = OBJ_ALLOCATED;
+
+  // Write header. Its left neighbour is the head fencepost, so freeObject
+  // never tries to coalesce past the start of the chunk. Fresh pages from
+  // mmap are zero-filled, and so is every object that is split off this
+  // chunk until something is freed into it.
+  ObjectHeader *currentHeader = (ObjectHeader *)(chunk + 1);
+  currentHeader->_objectSize = WHOLE_CHUNK_SIZE | OBJ_LEFT_ALLOCATED | OBJ_ZEROED;
+  setFooter(currentHeader);
+  
+  // Insert into its bin
+  fl_insert(currentHeader);
+  arena->_emptyChunks++;
+  
+  return currentHeader;
+}
+
+void fl_release(ObjectHeader * header) {
+  ArenaChunk * chunk = CHUNK_OF(header);
+  Arena * arena = chunk->_arena;
+  if (arena->_emptyChunks < _retainChunks) {
+    // Keep it around for the next burst of allocations
+    arena->_emptyChunks++;
+    return;
+  }
+
+  fl_remove(header);
+
+  chunk->_prev->_next = chunk->_next;
+  chunk->_next->_prev = chunk->_prev;
+
+  pagemap_set(chunk, arenaSize, NULL, 0);
+  releaseMemoryToOS(chunk, arenaSize);
+}
+
+ObjectHeader * split_chunk(ObjectHeader * header, size_t size) {
+  // Calculate position of next header
+  size_t leftoverMem = OBJ_SIZE(header) - size;
+
+  // Write fields to new header. Its left neighbour is the leftover, which
+  // stays free, and it inherits whether its memory is zero.
+  ObjectHeader * newHeader = (ObjectHeader *)((char *)header + leftoverMem);
+  newHeader->_objectSize = size | (header->_objectSize & OBJ_ZEROED);
+  newHeader->_listNext = NULL;
+  newHeader->_listPrev = NULL;
+  setFooter(newHeader);
+
+  // Update the header to the left
+  header->_objectSize = leftoverMem | (header->_objectSize & OBJ_FLAGS);
+  setFooter(header);
+
+  return newHeader;
+}
+
+void fl_remove(ObjectHeader * header) {
+  if (_bestFit && OBJ_SIZE(header) >= SMALL_BIN_LIMIT) {
+    tree_remove(CHUNK_OF(header)->_arena, (TreeChunk *)header);
+    return;
+  }
+
+  // Check to see if the chunk is actually in a bin
+  if (header->_listPrev == NULL || header->_listNext == NULL) {
+    return;
+  }
+  header->_listPrev->_listNext = header->_listNext;
+  header->_listNext->_listPrev = header->_listPrev;
+
+  // Clear the bin's bit if this was its last chunk
+  Arena * arena = CHUNK_OF(header)->_arena;
+  int bin = fl_bin(OBJ_SIZE(header));
+  if (arena->_freeBins[bin]._listNext == &arena->_freeBins[bin]) {
+    arena->_binMap[bin >> 6] &= ~(1UL << (bin & 63));
+  }
+
+  header->_listPrev = NULL;
+  header->_listNext = NULL;
+}
+
+void fl_insert(ObjectHeader * header) {
+  Arena * arena = CHUNK_OF(header)->_arena;
+  if (_bestFit && OBJ_SIZE(header) >= SMALL_BIN_LIMIT) {
+    tree_insert(arena, (TreeChunk *)header);
+    return;
+  }
+
+  int bin = fl_bin(OBJ_SIZE(header));
+  ObjectHeader * sentinel = &arena->_freeBins[bin];
+
+  sentinel->_listNext->_listPrev = header;
+  header->_listNext = sentinel->_listNext;
+  header->_listPrev = sentinel;
+  sentinel->_listNext = header;
+
+  arena->_binMap[bin >> 6] |= 1UL << (bin & 63);
+}
+
+// Quick list functions
+void quick_push(ObjectHeader * header) {
+  Arena * arena = CHUNK_OF(header)->_arena;
+  int list = OBJ_SIZE(header) >> 4;
+
+  // It stays allocated to its neighbours, but it has been written to
+  header->_objectSize &= ~(size_t)OBJ_ZEROED;
+  header->_listNext = arena->_quickLists[list];
+  arena->_quickLists[list] = header;
+  arena->_quickCount++;
+}
+
+ObjectHeader * quick_pop(Arena * arena, size_t size) {
+  int list = size >> 4;
+  ObjectHeader * header = arena->_quickLists[list];
+  if (header != NULL) {
+    arena->_quickLists[list] = header->_listNext;
+    arena->_quickCount--;
+  }
+  return header;
+}
+
+int quick_sweep(Arena * arena) {
+  if (arena->_quickCount == 0) {
+    return 0;
+  }
+
+  int list;
+  for (list = 0; list < NUM_QUICK_LISTS; list++) {
+    ObjectHeader * header = arena->_quickLists[list];
+    arena->_quickLists[list] = NULL;
+    while (header != NULL) {
+      ObjectHeader * next = header->_listNext;
+      coalesceObject(header);
+      header = next;
+    }
+  }
+  arena->_quickCount = 0;
+  return 1;
+}
+
+// Slab functions
+int slab_class(size_t size) {
+  return size ? (size - 1) / SLAB_GRANULE : 0;
+}
+
+size_t slab_size(int slabClass) {
+  return (slabClass + 1) * SLAB_GRANULE;
+}
+
+int is_slab(void * ptr) {
+  return _slabZone != NULL && (char *)ptr >= _slabZone && (char *)ptr < _slabZone + SLAB_ZONE_SIZE;
+}
+
+/*
+ * Takes an empty slab from the zone and sets it up for a size class.
+ */
+static Slab * slab_create(Arena * arena, int slabClass) {
+  lock_counted(&slabMutex, LOCK_ZONE);
+  Slab * slab = _emptySlabs;
+  if (slab != NULL) {
+    _emptySlabs = slab->_next;
+  } else if (_slabZoneTop < _slabZone + SLAB_ZONE_SIZE) {
+    // Make the zone accessible a slab at a time, or a whole huge page at a
+    // time so that the first touch can fault in a huge page
+    size_t step = _hugePages ? arenaSize : SLAB_SIZE;
+    if (_slabZoneTop < _slabZoneMapped ||
+        mprotect(_slabZoneMapped, step, PROT_READ | PROT_WRITE) == 0) {
+      if (_slabZoneTop == _slabZoneMapped) {
+        _slabZoneMapped += step;
+      }
+      slab = (Slab *)_slabZoneTop;
+      if (pagemap_set(slab, SLAB_SIZE, slab, PAGE_SLAB)) {
+        _slabZoneTop += SLAB_SIZE;
+      } else {
+        slab = NULL;
+      }
+    }
+  }
+  if (slab != NULL) {
+    _slabSize += SLAB_SIZE;
+  }
+  unlock_counted(&slabMutex, LOCK_ZONE);
+
+  if (slab == NULL) {
+    return NULL;
+  }
+
+  slab->_arena = arena;
+  slab->_objectSize = slab_size(slabClass);
+  slab->_class = slabClass;
+  slab->_capacity = (SLAB_SIZE - SLAB_DATA_OFFSET) / slab->_objectSize;
+  slab->_free = slab->_capacity;
+  slab->_hint = 0;
+
+  // Every slot starts out free
+  memset(slab->_freeMap, 0, sizeof(slab->_freeMap));
+  memset(slab->_freeMap, 0xff, (slab->_capacity / 64) * sizeof(unsigned long));
+  if (slab->_capacity % 64) {
+    slab->_freeMap[slab->_capacity / 64] = (1UL << (slab->_capacity % 64)) - 1;
+  }
+
+  // It becomes the head of its class list
+  slab->_prev = NULL;
+  slab->_next = arena->_slabs[slabClass];
+  if (slab->_next) {
+    slab->_next->_prev = slab;
+  }
+  arena->_slabs[slabClass] = slab;
+  return slab;
+}
+
+static void slab_unlink(Slab * slab) {
+  if (slab->_prev) {
+    slab->_prev->_next = slab->_next;
+  } else {
+    slab->_arena->_slabs[slab->_class] = slab->_next;
+  }
+  if (slab->_next) {
+    slab->_next->_prev = slab->_prev;
+  }
+  slab->_next = NULL;
+  slab->_prev = NULL;
+}
+
+static void * slab_take(Arena * arena, int slabClass) {
+  Slab * slab = arena->_slabs[slabClass];
+  if (slab == NULL) {
+    slab = slab_create(arena, slabClass);
+    if (slab == NULL) {
+      return NULL;
+    }
+  }
+
+  int word = slab->_hint;
+  while (slab->_freeMap[word] == 0) {
+    word++;
+  }
+  int bit = __builtin_ctzl(slab->_freeMap[word]);
+  slab->_freeMap[word] &= ~(1UL << bit);
+  slab->_hint = word;
+
+  // A full slab leaves the list until one of its slots is freed
+  if (--slab->_free == 0) {
+    slab_unlink(slab);
+  }
+
+  return (char *)slab + SLAB_DATA_OFFSET + (word * 64 + bit) * slab->_objectSize;
+}
+
+int slab_allocate(Arena * arena, int slabClass, void ** slots, int count) {
+  lock_counted(&arena->_slabLocks[slabClass], LOCK_SLAB);
+  int taken = 0;
+  while (taken < count && (slots[taken] = slab_take(arena, slabClass)) != NULL) {
+    taken++;
+  }
+  unlock_counted(&arena->_slabLocks[slabClass], LOCK_SLAB);
+  return taken;
+}
+
+void slab_free(void * ptr) {
+  // The slab cannot change class or arena while one of its slots is in use
+  Slab * slab = SLAB_OF(ptr);
+  Arena * arena = slab->_arena;
+  pthread_mutex_t * lock = &arena->_slabLocks[slab->_class];
+  lock_counted(lock, LOCK_SLAB);
+
+  int slot = ((char *)ptr - ((char *)slab + SLAB_DATA_OFFSET)) / slab->_objectSize;
+  int word = slot / 64;
+
+  slab->_freeMap[word] |= 1UL << (slot % 64);
+  if (word < slab->_hint) {
+    slab->_hint = word;
+  }
+
+  if (++slab->_free == 1) {
+    // It was full, so it is not in the list
+    slab->_prev = NULL;
+    slab->_next = arena->_slabs[slab->_class];
+    if (slab->_next) {
+      slab->_next->_prev = slab;
+    }
+    arena->_slabs[slab->_class] = slab;
+  }
+
+  // Keep the last slab of a class around; give the others back to the zone
+  // and their pages back to the OS once they are empty
+  if (slab->_free == slab->_capacity && (slab->_prev || slab->_next)) {
+    slab_unlink(slab);
+    if (!_hugePages) {
+      madvise((char *)slab + SLAB_DATA_OFFSET, SLAB_SIZE - SLAB_DATA_OFFSET, MADV_DONTNEED);
+    }
+
+    lock_counted(&slabMutex, LOCK_ZONE);
+    if (_hugePages) {
+      // Giving back part of a huge page would split it. The slab keeps its
+      // pages instead, and empty slabs are handed out lowest address
+      // first, so that the slabs in use stay packed in the first huge pages.
+      Slab ** link = &_emptySlabs;
+      while (*link != NULL && *link < slab) {
+        link = &(*link)->_next;
+      }
+      slab->_next = *link;
+      *link = slab;
+    } else {
+      slab->_next = _emptySlabs;
+      _emptySlabs = slab;
+    }
+    _slabSize -= SLAB_SIZE;
+    unlock_counted(&slabMutex, LOCK_ZONE);
+  }
+  unlock_counted(lock, LOCK_SLAB);
+}
+
+// Page map functions
+
+/*
+ * Returns the node that slot points to. A missing node is mapped and
+ * published if create is set; readers either see NULL or the whole node.
+ */
+static void * pagemap_child(void ** slot, int create) {
+  void * child = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (child != NULL || !create) {
+    return child;
+  }
+
+  pthread_mutex_lock(&pagemapMutex);
+  child = *slot;
+  if (child == NULL) {
+    child = mmap(NULL, PAGEMAP_FANOUT * sizeof(void *), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (child == MAP_FAILED) {
+      child = NULL;
+    } else {
+      __atomic_store_n(slot, child, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&pagemapMutex);
+  return child;
+}
+
+static unsigned long * pagemap_leaf(unsigned long page, int create) {
+  unsigned long top = page >> (2 * PAGEMAP_BITS);
+  if (top >= PAGEMAP_FANOUT) {
+    return NULL;
+  }
+  void ** middle = (void **)pagemap_child(&_pageMap[top], create);
+  if (middle == NULL) {
+    return NULL;
+  }
+  return (unsigned long *)pagemap_child(&middle[(page >> PAGEMAP_BITS) & (PAGEMAP_FANOUT - 1)], create);
+}
+
+int pagemap_set(void * start, size_t size, void * owner, int kind) {
+  unsigned long entry = owner ? (unsigned long)owner | kind : 0;
+  unsigned long page = (unsigned long)start >> PAGE_SHIFT;
+  unsigned long end = ((unsigned long)start + size + (1UL << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+  while (page < end) {
+    // Removing entries never maps a node; there is nothing to remove where
+    // one is missing
+    unsigned long * leaf = pagemap_leaf(page, owner != NULL);
+    unsigned long last = (page | (PAGEMAP_FANOUT - 1)) + 1;
+    if (last > end) {
+      last = end;
+    }
+    if (leaf == NULL && owner != NULL) {
+      return 0;
+    }
+    for (; leaf != NULL && page < last; page++) {
+      __atomic_store_n(&leaf[page & (PAGEMAP_FANOUT - 1)], entry, __ATOMIC_RELEASE);
+    }
+    page = last;
+  }
+  return 1;
+}
+
+unsigned long pagemap_get(void * ptr) {
+  unsigned long page = (unsigned long)ptr >> PAGE_SHIFT;
+  unsigned long * leaf = pagemap_leaf(page, 0);
+  if (leaf == NULL) {
+    return 0;
+  }
+  return __atomic_load_n(&leaf[page & (PAGEMAP_FANOUT - 1)], __ATOMIC_ACQUIRE);
+}
+
+// Region functions
+
+// Where allocation starts in a region chunk, and in the region's first chunk
+#define REGION_CHUNK_START ((sizeof(RegionChunk) + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1UL))
+#define REGION_START       ((sizeof(Region) + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1UL))
+
+Region * region_create() {
+  if (!_initialized) {
+    initialize();
+  }
+
+  Region * region = (Region *)getMemoryFromOS(arenaSize);
+  if (region == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  region->_first._next = NULL;
+  region->_first._size = arenaSize;
+  region_reset(region);
+  return region;
+}
+
+/*
+ * Moves on to the next chunk that holds size bytes, mapping a new one
+ * after the current chunk if no chunk left over from before a reset does.
+ * Chunks that are too small are skipped until the next reset.
+ */
+static void * region_grow(Region * region, size_t size) {
+  RegionChunk * chunk = region->_current->_next;
+  while (chunk != NULL && chunk->_size - REGION_CHUNK_START < size) {
+    chunk = chunk->_next;
+  }
+
+  if (chunk == NULL) {
+    if (size > (size_t)-1 - REGION_CHUNK_START - arenaSize) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    size_t mapSize = (size + REGION_CHUNK_START + arenaSize - 1) & ~((size_t)arenaSize - 1);
+    chunk = (RegionChunk *)getMemoryFromOS(mapSize);
+    if (chunk == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    chunk->_size = mapSize;
+    chunk->_next = region->_current->_next;
+    region->_current->_next = chunk;
+  }
+
+  region->_current = chunk;
+  region->_top = (char *)chunk + REGION_CHUNK_START + size;
+  region->_end = (char *)chunk + chunk->_size;
+  return (char *)chunk + REGION_CHUNK_START;
+}
+
+void * region_alloc(Region * region, size_t size) {
+  size_t roundedSize = ((size ? size : 1) + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1UL);
+  if (roundedSize < size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (roundedSize <= (size_t)(region->_end - region->_top)) {
+    void * ptr = region->_top;
+    region->_top += roundedSize;
+    return ptr;
+  }
+  return region_grow(region, roundedSize);
+}
+
+void region_reset(Region * region) {
+  region->_current = &region->_first;
+  region->_top = (char *)region + REGION_START;
+  region->_end = (char *)region + arenaSize;
+}
+
+void region_destroy(Region * region) {
+  RegionChunk * chunk = region->_first._next;
+  while (chunk != NULL) {
+    RegionChunk * next = chunk->_next;
+    releaseMemoryToOS(chunk, chunk->_size);
+    chunk = next;
+  }
+  releaseMemoryToOS(region, arenaSize);
+}
+
+// Decay functions
+
+/*
+ * Gives back the pages of a free run, all but the ones that hold its
+ * header, tree node, stamp and footer.
+ */
+static void decay_run(ObjectHeader * header) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  unsigned long start = ((unsigned long)&DECAY_STAMP(header) + sizeof(unsigned long) + pageSize - 1) & ~(pageSize - 1);
+  unsigned long end = ((unsigned long)header + OBJ_SIZE(header) - HEADER_SIZE) & ~(pageSize - 1);
+  if (end > start) {
+    madvise((void *)start, end - start, MADV_DONTNEED);
+    __atomic_fetch_add(&_purgedSize, end - start, __ATOMIC_RELAXED);
+  }
+  DECAY_STAMP(header) = DECAY_PURGED;
+}
+
+/*
+ * A run is due once it has been free for three epoch changes, that is for
+ * at least two epochs, the decay time.
+ */
+static int decay_due(ObjectHeader * header, unsigned long epoch) {
+  return OBJ_SIZE(header) >= DECAY_MIN_SIZE && !(header->_objectSize & OBJ_ZEROED) &&
+         DECAY_STAMP(header) != DECAY_PURGED && DECAY_STAMP(header) + 3 <= epoch;
+}
+
+/*
+ * Purges the due runs of a subtree. Ordered by size, left subtrees of runs
+ * too small to purge only hold smaller runs. Ordered by address, a subtree
+ * is skipped when its largest run is too small.
+ */
+static void decay_tree(TreeChunk * node, unsigned long epoch) {
+  while (node != NULL) {
+    if (_addressOrder) {
+      if (node->_maxSize < DECAY_MIN_SIZE) {
+        return;
+      }
+      decay_tree(node->_left, epoch);
+      if (decay_due((ObjectHeader *)node, epoch)) {
+        decay_run((ObjectHeader *)node);
+      }
+    } else if (OBJ_SIZE(node) >= DECAY_MIN_SIZE) {
+      decay_tree(node->_left, epoch);
+      if (decay_due((ObjectHeader *)node, epoch)) {
+        decay_run((ObjectHeader *)node);
+      }
+    }
+    node = node->_right;
+  }
+}
+
+void decay_purge(Arena * arena, unsigned long epoch) {
+  int bin = fl_next_bin(arena, fl_bin(DECAY_MIN_SIZE));
+  while (bin >= 0) {
+    ObjectHeader * curr = arena->_freeBins[bin]._listNext;
+    while (curr != &arena->_freeBins[bin]) {
+      if (decay_due(curr, epoch)) {
+        decay_run(curr);
+      }
+      curr = curr->_listNext;
+    }
+    bin = bin + 1 < NUM_BINS ? fl_next_bin(arena, bin + 1) : -1;
+  }
+
+  if (_bestFit) {
+    decay_tree(arena->_tree, epoch);
+  }
+}
+
+/*
+ * Advances the epoch every half decay time and purges what is due in every
+ * arena. Signals are left to the program's own threads.
+ */
+static void * decay_thread(void * unused) {
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  long period = _decayTime / 2 > 0 ? _decayTime / 2 : 1;
+  struct timespec sleep = { period / 1000, (period % 1000) * 1000000 };
+  for (;;) {
+    nanosleep(&sleep, NULL);
+    unsigned long epoch = __atomic_add_fetch(&_decayEpoch, 1, __ATOMIC_RELAXED);
+
+    int a;
+    for (a = 0; a < _numArenas; a++) {
+      Arena * arena = &_arenas[a];
+      lock_arena(arena);
+      decay_purge(arena, epoch);
+      unlock_arena(arena);
+    }
+  }
+  return NULL;
+}
+
+void decay_start() {
+  if (_decayTime <= 0 || __atomic_exchange_n(&_decayStarted, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+
+  // What pthread_create allocates for the thread is the heap's own, not the
+  // program's
+  StatsShard * shard = _threadStats;
+  _threadStats = &_internalShard;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread, &attr, decay_thread, NULL);
+  pthread_attr_destroy(&attr);
+
+  _threadStats = shard;
+}
+
+/*
+ * The thread does not survive fork. The child starts its own on its first
+ * free.
+ */
+static void decay_forked() {
+  _decayStarted = 0;
+}
+
+// Thread cache functions
+
+/*
+ * Moves from holding the lock of arena locked to holding the lock of arena
+ * wanted. Either may be null. Returns the arena now locked.
+ */
+static Arena * tc_switch_arena(Arena * locked, Arena * wanted) {
+  if (locked != wanted) {
+    if (locked)
+      unlock_arena(locked);
+    if (wanted)
+      lock_arena(wanted);
+  }
+  return wanted;
+}
+
+/*
+ * Frees a cached object, either onto its arena's remote frees or under its
+ * arena's lock. Returns the arena now locked, like tc_switch_arena.
+ */
+static Arena * tc_release(Arena * locked, void * ptr) {
+  if (is_slab(ptr)) {
+    // Slab class locks are never taken under an arena's
+    tc_switch_arena(locked, NULL);
+    slab_free(ptr);
+    return NULL;
+  }
+
+  Arena * arena = CHUNK_OF(ptr)->_arena;
+  if (remote_free(arena, ptr))
+    return locked;
+
+  locked = tc_switch_arena(locked, arena);
+  freeObject(ptr);
+  return locked;
+}
+
+/*
+ * Pops a slab object of the size class, refilling the list in one lock
+ * acquisition if it is empty.
+ */
+static void * tc_allocate_slab(ThreadCache * tc, int slabClass) {
+  if (tc->_slabBins[slabClass] == NULL) {
+    void * slots[TCACHE_BATCH];
+    int taken = slab_allocate(arena_get(), slabClass, slots, TCACHE_BATCH);
+    int i;
+    for (i = 0; i < taken; i++) {
+      *(void **)slots[i] = tc->_slabBins[slabClass];
+      tc->_slabBins[slabClass] = slots[i];
+      tc->_slabCounts[slabClass]++;
+    }
+
+    if (tc->_slabBins[slabClass] == NULL) {
+      return NULL;
+    }
+
+    if (!tc->_registered) {
+      pthread_setspecific(_threadCacheKey, tc);
+      tc->_registered = 1;
+    }
+  }
+
+  void * slot = tc->_slabBins[slabClass];
+  tc->_slabBins[slabClass] = *(void **)slot;
+  tc->_slabCounts[slabClass]--;
+  return slot;
+}
+
+void * tc_allocate(size_t size) {
+  // The first call sets up the heap under the lock
+  if (!_initialized || size >= SMALL_BIN_LIMIT) {
+    return NULL;
+  }
+
+  if (_slabsEnabled && size <= SLAB_MAX_SIZE) {
+    return tc_allocate_slab(&_threadCache, slab_class(size));
+  }
+
+  size_t roundedSize = objectSizeFor(size);
+  if (roundedSize >= SMALL_BIN_LIMIT) {
+    return NULL;
+  }
+
+  ThreadCache * tc = &_threadCache;
+  int bin = roundedSize >> 4;
+
+  if (tc->_bins[bin] == NULL && _deferCoalescing && roundedSize < QUICK_LIMIT) {
+    // Refill from the quick list of this size before carving a new block
+    Arena * arena = arena_lock();
+    int i;
+    for (i = 0; i < TCACHE_BATCH; i++) {
+      ObjectHeader * quick = quick_pop(arena, roundedSize);
+      if (quick == NULL) {
+        break;
+      }
+      quick->_listNext = tc->_bins[bin];
+      tc->_bins[bin] = quick;
+      tc->_counts[bin]++;
+    }
+    unlock_arena(arena);
+  }
+
+  if (tc->_bins[bin] == NULL) {
+    // Carve one chunk for the whole batch and cut it into pieces. The pieces
+    // are pushed lowest address first, so that they are handed out from the
+    // top of the block down, like split_chunk does for single objects.
+    Arena * arena = arena_lock();
+    char * block = (char *)allocateObject(arena, roundedSize * TCACHE_BATCH - HEADER_SIZE);
+    unlock_arena(arena);
+    if (block == NULL) {
+      return NULL;
+    }
+
+    ObjectHeader * blockHeader = (ObjectHeader *)(block - HEADER_SIZE);
+    cutBlock(blockHeader, roundedSize, TCACHE_BATCH);
+
+    int i;
+    for (i = 0; i < TCACHE_BATCH; i++) {
+      ObjectHeader * piece = (ObjectHeader *)((char *)blockHeader + i * roundedSize);
+      int pieceBin = OBJ_SIZE(piece) < SMALL_BIN_LIMIT ? OBJ_SIZE(piece) >> 4 : bin;
+      piece->_listNext = tc->_bins[pieceBin];
+      tc->_bins[pieceBin] = piece;
+      tc->_counts[pieceBin]++;
+    }
+
+    if (!tc->_registered) {
+      pthread_setspecific(_threadCacheKey, tc);
+      tc->_registered = 1;
+    }
+  }
+
+  ObjectHeader * header = tc->_bins[bin];
+  tc->_bins[bin] = header->_listNext;
+  tc->_counts[bin]--;
+
+  return (void *)((char *)header + HEADER_SIZE);
+}
+
+void tc_free_slab(void * ptr, int slabClass) {
+  ThreadCache * tc = &_threadCache;
+  if (tc->_slabCounts[slabClass] >= TCACHE_MAX_COUNT) {
+    Arena * locked = NULL;
+    int i;
+    for (i = 0; i < TCACHE_BATCH; i++) {
+      void * cached = tc->_slabBins[slabClass];
+      tc->_slabBins[slabClass] = *(void **)cached;
+      locked = tc_release(locked, cached);
+    }
+    tc_switch_arena(locked, NULL);
+    tc->_slabCounts[slabClass] -= TCACHE_BATCH;
+  }
+
+  *(void **)ptr = tc->_slabBins[slabClass];
+  tc->_slabBins[slabClass] = ptr;
+  tc->_slabCounts[slabClass]++;
+
+  if (!tc->_registered) {
+    pthread_setspecific(_threadCacheKey, tc);
+    tc->_registered = 1;
+  }
+}
+
+int tc_free(void * ptr) {
+  if (!_initialized) {
+    return 0;
+  }
+
+  ThreadCache * tc = &_threadCache;
+
+  if (is_slab(ptr)) {
+    tc_free_slab(ptr, SLAB_OF(ptr)->_class);
+    return 1;
+  }
+
+  // Large objects are never below SMALL_BIN_LIMIT
+  ObjectHeader * header = (ObjectHeader *)((char *)ptr - HEADER_SIZE);
+  if (OBJ_SIZE(header) >= SMALL_BIN_LIMIT) {
+    return 0;
+  }
+
+  int bin = OBJ_SIZE(header) >> 4;
+
+  if (tc->_counts[bin] >= TCACHE_MAX_COUNT) {
+    // Give back a batch, taking each arena's lock once per run of its chunks
+    // that are not pushed onto their arena's remote frees
+    Arena * locked = NULL;
+    int i;
+    for (i = 0; i < TCACHE_BATCH; i++) {
+      ObjectHeader * cached = tc->_bins[bin];
+      tc->_bins[bin] = cached->_listNext;
+      locked = tc_release(locked, (char *)cached + HEADER_SIZE);
+    }
+    tc_switch_arena(locked, NULL);
+    tc->_counts[bin] -= TCACHE_BATCH;
+  }
+
+  header->_listNext = tc->_bins[bin];
+  tc->_bins[bin] = header;
+  tc->_counts[bin]++;
+
+  if (!tc->_registered) {
+    pthread_setspecific(_threadCacheKey, tc);
+    tc->_registered = 1;
+  }
+  return 1;
+}
+
+void tc_flush(ThreadCache * tc) {
+  Arena * locked = NULL;
+  int bin;
+  for (bin = 0; bin < NUM_SMALL_BINS; bin++) {
+    while (tc->_bins[bin] != NULL) {
+      ObjectHeader * cached = tc->_bins[bin];
+      tc->_bins[bin] = cached->_listNext;
+      locked = tc_release(locked, (char *)cached + HEADER_SIZE);
+    }
+    tc->_counts[bin] = 0;
+  }
+  for (bin = 0; bin < NUM_SLAB_CLASSES; bin++) {
+    while (tc->_slabBins[bin] != NULL) {
+      void * cached = tc->_slabBins[bin];
+      tc->_slabBins[bin] = *(void **)cached;
+      locked = tc_release(locked, cached);
+    }
+    tc->_slabCounts[bin] = 0;
+  }
+  tc_switch_arena(locked, NULL);
+}
+
+// Heap profiler functions
+
+static void profile_signal(int sig) {
+  // Writing the profile takes the profiler's lock, which the interrupted
+  // code may hold, so it is left to the next sampled allocation
+  _profileDumpPending = 1;
+}
+
+void profile_start(size_t interval) {
+  pthread_mutex_lock(&profileMutex);
+  if (_profileTable == NULL && interval) {
+    void * table = mmap(NULL, PROFILE_BUCKETS * sizeof(ProfileSample *), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+      pthread_mutex_unlock(&profileMutex);
+      return;
+    }
+    _profileTable = (ProfileSample **)table;
+
+    // Only take SIGUSR2 if the program has not
+    struct sigaction old;
+    if (sigaction(SIGUSR2, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = profile_signal;
+      action.sa_flags = SA_RESTART;
+      sigaction(SIGUSR2, &action, NULL);
+    }
+  }
+  __atomic_store_n(&_profileInterval, interval, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&profileMutex);
+}
+
+static unsigned long profile_bucket(void * ptr) {
+  return ((unsigned long)ptr >> 4) * 0x9E3779B97F4A7C15UL >> (64 - 16);
+}
+
+/*
+ * Returns the bytes until the next sample. Gaps between samples are drawn
+ * from an exponential distribution with mean _profileInterval, so every
+ * byte allocated is equally likely to be sampled.
+ */
+static long profile_next_gap(ProfileThread * pt) {
+  // xorshift64*
+  pt->_random ^= pt->_random >> 12;
+  pt->_random ^= pt->_random << 25;
+  pt->_random ^= pt->_random >> 27;
+  unsigned long r = pt->_random * 0x2545F4914F6CDD1DUL;
+
+  // -ln(u) for u uniform in (0, 1]. The log comes from the exponent of u
+  // and a quadratic fit to log2 of its mantissa, which is close enough
+  // for sampling and needs no libm
+  union { double d; unsigned long u; } u;
+  u.d = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+  int exponent = (int)((u.u >> 52) & 0x7ff) - 1023;
+  u.u = (u.u & ((1UL << 52) - 1)) | (1023UL << 52);
+  double log2u = exponent + (-0.34484843 * u.d + 2.02466578) * u.d - 0.67487759;
+
+  double gap = -log2u * 0.6931471805599453 * _profileInterval;
+  return gap < 1 ? 1 : (long)gap;
+}
+
+void profile_allocated(void * ptr, size_t size) {
+  ProfileThread * pt = &_profileThread;
+  if (pt->_busy) {
+    return;
+  }
+  if (!pt->_seeded) {
+    pt->_random = ((unsigned long)pt ^ 0x9E3779B97F4A7C15UL) | 1;
+    pt->_untilSample = profile_next_gap(pt);
+    pt->_seeded = 1;
+  }
+  pt->_untilSample -= size;
+  if (pt->_untilSample > 0) {
+    return;
+  }
+  pt->_untilSample = profile_next_gap(pt);
+
+  // A dump asked for by SIGUSR2 is written by the next sampled allocation
+  if (_profileDumpPending) {
+    _profileDumpPending = 0;
+    profile_dump(NULL);
+  }
+
+  // backtrace may allocate the first time it is called; those allocations
+  // are neither sampled nor counted as the program's
+  pt->_busy = 1;
+  StatsShard * shard = _threadStats;
+  _threadStats = &_internalShard;
+  void * stack[PROFILE_MAX_DEPTH + 2];
+  int depth = backtrace(stack, PROFILE_MAX_DEPTH + 2);
+  _threadStats = shard;
+  pt->_busy = 0;
+
+  pthread_mutex_lock(&profileMutex);
+  ProfileSample * sample = _profileFree;
+  if (sample == NULL) {
+    // Carve a page worth of samples
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t poolSize = (64 * sizeof(ProfileSample) + pageSize - 1) & ~(pageSize - 1);
+    char * pool = (char *)mmap(NULL, poolSize, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+      pthread_mutex_unlock(&profileMutex);
+      return;
+    }
+    size_t i;
+    for (i = 0; i + sizeof(ProfileSample) <= poolSize; i += sizeof(ProfileSample)) {
+      ((ProfileSample *)(pool + i))->_next = _profileFree;
+      _profileFree = (ProfileSample *)(pool + i);
+    }
+    sample = _profileFree;
+  }
+  _profileFree = sample->_next;
+
+  // The first two frames are this function and the malloc that called it
+  sample->_ptr = ptr;
+  sample->_size = size;
+  sample->_depth = depth > 2 ? depth - 2 : 0;
+  memcpy(sample->_stack, stack + 2, sample->_depth * sizeof(void *));
+
+  unsigned long bucket = profile_bucket(ptr);
+  sample->_next = _profileTable[bucket];
+  __atomic_store_n(&_profileTable[bucket], sample, __ATOMIC_RELAXED);
+  _profileObjects++;
+  _profileBytes += size;
+  pthread_mutex_unlock(&profileMutex);
+}
+
+void profile_freed(void * ptr) {
+  // An object can only be sampled after it was allocated, and it can only
+  // be freed after that, so an empty bucket seen here stays empty for ptr
+  unsigned long bucket = profile_bucket(ptr);
+  if (__atomic_load_n(&_profileTable[bucket], __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&profileMutex);
+  ProfileSample ** link = &_profileTable[bucket];
+  while (*link != NULL && (*link)->_ptr != ptr) {
+    link = &(*link)->_next;
+  }
+  ProfileSample * sample = *link;
+  if (sample != NULL) {
+    __atomic_store_n(link, sample->_next, __ATOMIC_RELAXED);
+    _profileObjects--;
+    _profileBytes -= sample->_size;
+    sample->_next = _profileFree;
+    _profileFree = sample;
+  }
+  pthread_mutex_unlock(&profileMutex);
+}
+
+/*
+ * Output buffer for profile_dump, which cannot use stdio since stdio
+ * allocates.
+ */
+typedef struct ProfileWriter {
+  int _fd;
+  int _used;
+  char _buffer[4096];
+} ProfileWriter;
+
+static void profile_flush(ProfileWriter * w) {
+  char * p = w->_buffer;
+  while (w->_used > 0) {
+    ssize_t n = write(w->_fd, p, w->_used);
+    if (n <= 0)
+      break;
+    p += n;
+    w->_used -= n;
+  }
+  w->_used = 0;
+}
+
+static void profile_printf(ProfileWriter * w, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+static void profile_printf(ProfileWriter * w, const char * format, ...) {
+  if (w->_used > (int)sizeof(w->_buffer) - 256)
+    profile_flush(w);
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(w->_buffer + w->_used, sizeof(w->_buffer) - w->_used, format, args);
+  va_end(args);
+  if (n > 0)
+    w->_used += n < (int)sizeof(w->_buffer) - w->_used ? n : (int)sizeof(w->_buffer) - w->_used - 1;
+}
+
+/*
+ * Writes the legacy heap profile format of gperftools, which pprof reads:
+ * a header with the totals and the sampling interval, one line per sample
+ * with its object count, bytes and call stack, then the process's mappings
+ * so that the addresses can be symbolized.
+ */
+int profile_dump(const char * path) {
+  char name[512];
+  if (path == NULL) {
+    int dump = __atomic_fetch_add(&_profileDumps, 1, __ATOMIC_RELAXED);
+    snprintf(name, sizeof(name), "%s.%d.%04d.heap", _profilePrefix, (int)getpid(), dump);
+    path = name;
+  }
+
+  ProfileWriter w;
+  w._fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  w._used = 0;
+  if (w._fd < 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&profileMutex);
+  profile_printf(&w, "heap profile: %8lu: %8zu [%8lu: %8zu] @ heap_v2/%zu\n",
+                 _profileObjects, _profileBytes, _profileObjects, _profileBytes, _profileInterval);
+  unsigned long bucket;
+  for (bucket = 0; _profileTable && bucket < PROFILE_BUCKETS; bucket++) {
+    ProfileSample * sample;
+    for (sample = _profileTable[bucket]; sample != NULL; sample = sample->_next) {
+      profile_printf(&w, "%8d: %8zu [%8d: %8zu] @", 1, sample->_size, 1, sample->_size);
+      int i;
+      for (i = 0; i < sample->_depth; i++) {
+        profile_printf(&w, " %p", sample->_stack[i]);
+      }
+      profile_printf(&w, "\n");
+    }
+  }
+  pthread_mutex_unlock(&profileMutex);
+
+  profile_printf(&w, "\nMAPPED_LIBRARIES:\n");
+  profile_flush(&w);
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps >= 0) {
+    ssize_t n;
+    while ((n = read(maps, w._buffer, sizeof(w._buffer))) > 0) {
+      w._used = n;
+      profile_flush(&w);
+    }
+    close(maps);
+  }
+
+  close(w._fd);
+  return 1;
+}
+
+// Trace recorder functions
+
+static unsigned long trace_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static void trace_write(const void * data, size_t size) {
+  const char * p = (const char *)data;
+  while (size > 0) {
+    ssize_t n = write(_traceFd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+/*
+ * The child of a fork drops the records it inherited, which the parent
+ * writes, and starts a trace of its own if the trace is named after
+ * MALLOCTRACE.
+ */
+static void trace_forked() {
+  if (_traceFd < 0) {
+    return;
+  }
+  if (_traceBuffer != NULL) {
+    _traceBuffer->_used = 0;
+  }
+  close(_traceFd);
+  _traceFd = -1;
+  if (_tracePrefix != NULL) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s.%d.trace", _tracePrefix, getpid());
+    _traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  }
+}
+
+int trace_start(const char * path) {
+  pthread_mutex_lock(&traceMutex);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd >= 0 && _traceFd < 0) {
+    _traceStart = trace_now();
+  } else if (fd >= 0) {
+    close(_traceFd);
+  }
+  if (fd >= 0) {
+    _traceFd = fd;
+  }
+  pthread_mutex_unlock(&traceMutex);
+  return fd >= 0;
+}
+
+static TraceBuffer * trace_attach() {
+  pthread_mutex_lock(&traceMutex);
+  TraceBuffer * buffer = _traceFree;
+  if (buffer != NULL) {
+    _traceFree = buffer->_nextFree;
+  } else {
+    buffer = (TraceBuffer *)mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+      pthread_mutex_unlock(&traceMutex);
+      return NULL;
+    }
+  }
+  buffer->_thread = ++_traceThreads;
+  buffer->_used = 0;
+  buffer->_lastTime = 0;
+  pthread_mutex_unlock(&traceMutex);
+  _traceBuffer = buffer;
+
+  // The buffer is written and handed on by the thread cache's destructor
+  if (_initialized && !_threadCache._registered) {
+    pthread_setspecific(_threadCacheKey, &_threadCache);
+    _threadCache._registered = 1;
+  }
+  return buffer;
+}
+
+static void trace_retire() {
+  TraceBuffer * buffer = _traceBuffer;
+  _traceRetired = 1;
+  if (buffer == NULL) {
+    return;
+  }
+
+  trace_flush();
+  _traceBuffer = NULL;
+  pthread_mutex_lock(&traceMutex);
+  buffer->_nextFree = _traceFree;
+  _traceFree = buffer;
+  pthread_mutex_unlock(&traceMutex);
+}
+
+void trace_record(unsigned int op, size_t size, void * ptr, unsigned long arg) {
+  if (_traceFd < 0) {
+    return;
+  }
+
+  TraceBuffer * buffer = _traceBuffer;
+  if (buffer == NULL && !_traceRetired) {
+    buffer = trace_attach();
+  }
+
+  unsigned long now = trace_now() - _traceStart;
+  if (buffer == NULL) {
+    TraceRecord record = { now, size, (unsigned long)ptr, arg, 0, op };
+    trace_write(&record, sizeof(record));
+    return;
+  }
+
+  // Records of a thread must replay in order, even if the clock stands still
+  if (now <= buffer->_lastTime) {
+    now = buffer->_lastTime + 1;
+  }
+  buffer->_lastTime = now;
+
+  TraceRecord * record = &buffer->_records[buffer->_used];
+  record->_time = now;
+  record->_size = size;
+  record->_ptr = (unsigned long)ptr;
+  record->_arg = arg;
+  record->_thread = buffer->_thread;
+  record->_op = op;
+  if (++buffer->_used == TRACE_BUFFER_RECORDS) {
+    trace_flush();
+  }
+}
+
+void trace_flush() {
+  TraceBuffer * buffer = _traceBuffer;
+  if (buffer == NULL || buffer->_used == 0) {
+    return;
+  }
+  trace_write(buffer->_records, buffer->_used * sizeof(TraceRecord));
+  buffer->_used = 0;
 }
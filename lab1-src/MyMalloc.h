@@ -5,44 +5,366 @@
  * with the allocator are defined here.
  */
 
-// Header of an object. Used both when the object is allocated and freed
+#include <stddef.h>
+#include <pthread.h>
+
+// Header of an object. An allocated object only pays for _objectSize; the
+// list links are stored in the payload while the object is free. A free
+// object also ends with a footer holding its size, which is how the object
+// to its right finds it when the two coalesce.
 typedef struct ObjectHeader {
-    size_t _objectSize;             // Real size of the object.
-    int _leftObjectSize;            // Real size of the previous contiguous chunk in memory
-    int _allocated;                 // 1 = yes, 0 = no.
+    size_t _objectSize;             // Real size of the object, with the OBJ_ flags in its low bits.
     struct ObjectHeader *_listNext; // Points to the next object in the freelist (if free).
     struct ObjectHeader *_listPrev; // Points to the previous object.
 } ObjectHeader;
 
+#define HEADER_SIZE     sizeof(size_t)  // Bytes of ObjectHeader kept while allocated
+#define OBJECT_ALIGN    16              // Object sizes and payloads are multiples of this
+#define MIN_OBJECT_SIZE 32              // Header, two links and a footer
+
+#define OBJ_ALLOCATED      1   // The object is in use
+#define OBJ_LEFT_ALLOCATED 2   // The object to the left is in use, so there is no footer before this header
+#define OBJ_MMAPPED        4   // The object has a mapping of its own (see allocateLargeObject)
+#define OBJ_ZEROED         8   // The object's memory is known to be all zeros
+#define OBJ_FLAGS          15
+
+#define OBJ_SIZE(header) ((header)->_objectSize & ~(size_t)OBJ_FLAGS)
+
+// The heap grows in ARENA_SIZE chunks aligned to ARENA_SIZE. Each starts with
+// an ArenaChunk, so the chunk that holds an object is found by masking the
+// object's address.
+#define ARENA_SIZE 2097152
+
+typedef struct ArenaChunk {
+    struct Arena *_arena;        // Arena the chunk belongs to
+    struct ArenaChunk *_next;    // Next chunk of the arena
+    struct ArenaChunk *_prev;    // Previous chunk of the arena
+    size_t _pad;                 // Keeps the payloads of the chunk's objects 16-byte aligned
+    size_t _fencePost;           // Header of the head fencepost, an allocated object of size 0
+} ArenaChunk;
+
+#define CHUNK_OF(ptr) ((ArenaChunk *)((unsigned long)(ptr) & ~((unsigned long)ARENA_SIZE - 1)))
+
+// An object with a mapping of its own. Its header is the last field, right
+// before the payload, and holds the size of the whole mapping.
+typedef struct LargeObject {
+    struct LargeObject *_next;   // Next large object
+    struct LargeObject *_prev;   // Previous large object
+    char *_mapStart;             // Start of the mapping
+    size_t _objectSize;          // Header of the object
+} LargeObject;
+
+#define LARGE_OF(header) ((LargeObject *)((char *)(header) - offsetof(LargeObject, _objectSize)))
+
+// Free chunks are binned by size. Chunks smaller than SMALL_BIN_LIMIT get one
+// bin per 16-byte size; larger chunks fall into geometric bins, four per power
+// of two. A bitmap records which bins are non-empty.
+#define SMALL_BIN_LIMIT 512
+#define NUM_SMALL_BINS  (SMALL_BIN_LIMIT >> 4)
+#define BIN_SUBDIVISIONS 4
+#define NUM_BINS        128
+#define BINMAP_WORDS    (NUM_BINS / 64)
+
+// With MALLOCFIT=ADDRESS, freed objects smaller than QUICK_LIMIT bytes are
+// not coalesced at once but pushed onto their arena's quick list for their
+// size, still marked allocated. They are handed out again as they are, and
+// all coalesced in one sweep when a search of the bins misses, or when an
+// object of QUICK_SWEEP_SIZE bytes or more is freed.
+#define QUICK_LIMIT      256
+#define NUM_QUICK_LISTS  (QUICK_LIMIT >> 4)
+#define QUICK_SWEEP_SIZE 65536
+
+// With best fit, chunks of SMALL_BIN_LIMIT bytes and up are kept in a
+// red-black tree ordered by size and then address instead of the geometric
+// bins. With MALLOCFIT=ADDRESS the tree is ordered by address alone, and
+// each node knows the largest chunk below it, so that the lowest chunk that
+// fits is found in one descent. A TreeChunk overlays the payload of such a
+// free chunk.
+typedef struct TreeChunk {
+    size_t _objectSize;          // Same as the chunk's ObjectHeader
+    struct TreeChunk *_left;     // Smaller chunks
+    struct TreeChunk *_right;    // Larger chunks
+    struct TreeChunk *_parent;   // NULL at the root
+    size_t _maxSize;             // Size of the largest chunk of the subtree (address order only)
+    int _red;                    // 1 = red, 0 = black
+} TreeChunk;
+
+// Each thread keeps freed chunks of the small bin sizes in its own cache, so
+// that the common malloc/free pair never takes the heap lock. Chunks in a
+// cache stay marked allocated and are chained through _listNext.
+#define TCACHE_MAX_COUNT 32   // Chunks a cache holds per size before flushing
+#define TCACHE_BATCH     16   // Chunks moved between a cache and the heap at once
+
+// Objects of up to SLAB_MAX_SIZE bytes come from slabs: SLAB_SIZE-aligned
+// blocks of equal-sized slots with a free bitmap and no per-object header.
+// All slabs are carved from one reserved zone, so a pointer is a slab object
+// if it falls inside the zone, and its slab is found by masking its address.
+// Slot sizes are multiples of OBJECT_ALIGN, so that slab objects are as
+// aligned as arena objects.
+#define SLAB_MAX_SIZE    256
+#define SLAB_GRANULE     OBJECT_ALIGN
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_SIZE        65536
+#define SLAB_MAP_WORDS   (SLAB_SIZE / SLAB_GRANULE / 64)
+#define SLAB_ZONE_SIZE   (1UL << 30)
+
+typedef struct Slab {
+    struct Slab *_next;         // Next slab of the arena's class list (if it has free slots)
+    struct Slab *_prev;         // Previous slab of the list, NULL at the head
+    struct Arena *_arena;       // Arena that owns the slab
+    int _objectSize;            // Size of every slot
+    int _class;                 // Index of the size class
+    int _capacity;              // Number of slots
+    int _free;                  // Number of free slots
+    int _hint;                  // No word of _freeMap below this one has a free slot
+    unsigned long _freeMap[SLAB_MAP_WORDS]; // Bit i set if slot i is free
+} Slab;
+
+// Slots start at a multiple of SLAB_DATA_ALIGN, so a slot whose size is a
+// multiple of an alignment up to SLAB_DATA_ALIGN is aligned to it
+#define SLAB_DATA_ALIGN  64
+#define SLAB_DATA_OFFSET ((sizeof(Slab) + SLAB_DATA_ALIGN - 1) & ~(SLAB_DATA_ALIGN - 1UL))
+#define SLAB_OF(ptr) ((Slab *)((unsigned long)(ptr) & ~((unsigned long)SLAB_SIZE - 1)))
+
+// Every page that objects are handed out of is entered in a radix tree keyed
+// by page number, so that the owner of any address is found with three loads
+// and no lock. Each level resolves PAGEMAP_BITS bits of the page number. An
+// entry is the ArenaChunk, Slab or LargeObject that holds the page, with the
+// kind of owner in its low bits, or 0 if the page is not the allocator's.
+#define PAGE_SHIFT     12
+#define PAGEMAP_BITS   12
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+
+#define PAGE_ARENA 1   // The page is in a 2MB chunk of an arena
+#define PAGE_SLAB  2   // The page is in a slab
+#define PAGE_LARGE 3   // The page is in a large object's mapping
+
+#define PAGE_KIND(entry)  ((int)((entry) & 3))
+#define PAGE_OWNER(entry) ((void *)((entry) & ~3UL))
+
+// Free runs of at least DECAY_MIN_SIZE bytes that stay free for the decay
+// time have their pages given back with madvise. Right after its TreeChunk,
+// such a run holds the decay epoch it was freed in, or DECAY_PURGED once its
+// pages are gone. Runs that are still zero from the OS carry no stamp.
+#define DECAY_MIN_SIZE 8192
+#define DECAY_PURGED   (~0UL)
+#define DECAY_STAMP(header) (*(unsigned long *)((char *)(header) + sizeof(TreeChunk)))
+
+// The heap is split into arenas, each with its own bins, 2MB chunks and lock.
+// Threads are spread over the arenas, and a chunk always goes back to the
+// arena it was carved from. Each slab size class of an arena has a lock of
+// its own, so that small objects of different sizes never wait on each other
+// or on the bins. Locks are taken in this order: growth lock, arena lock,
+// slab class lock, slab zone lock, large object lock, page map lock. Fork
+// takes them all in that order; otherwise no slab class or large object
+// lock is taken while an arena's is held.
+#define MAX_ARENAS 64
+
+typedef struct Arena {
+    pthread_mutex_t _growLock;            // Held while a 2MB chunk is mapped for the arena
+    pthread_mutex_t _slabLocks[NUM_SLAB_CLASSES];  // Protect _slabs, one per size class
+    Slab *_slabs[NUM_SLAB_CLASSES];       // Slabs with free slots, per size class
+    pthread_mutex_t _lock;                // Protects everything below
+    ObjectHeader _freeBins[NUM_BINS];     // Sentinels of the size-class free lists
+    unsigned long _binMap[BINMAP_WORDS];  // Bit i set if bin i is non-empty
+    TreeChunk *_tree;                     // Root of the tree of large free chunks (best fit only)
+    ArenaChunk _chunks;                   // Sentinel of the list of the arena's 2MB chunks
+    int _emptyChunks;                     // Chunks that are one free object between their fenceposts
+    ObjectHeader *_quickLists[NUM_QUICK_LISTS]; // Objects waiting to be coalesced, per size, chained through _listNext
+    int _quickCount;                      // Objects in the quick lists
+    void *_remoteFrees;                   // Objects freed by threads that use other arenas, chained
+                                          // through their first word. Pushed without the lock
+    int _index;                           // Position in _arenas
+} Arena;
+
+// Statistics are counted by each thread in a shard of its own and summed up
+// by stats_get, so that counting never needs a lock or a shared cache line.
+// Size class k counts objects of 2^(k-1)+1 to 2^k usable bytes.
+#define STATS_SIZE_CLASSES 48
+
+// With MALLOCLOCKSTATS=YES, every kind of heap lock counts how often it is
+// taken, how often and how long threads wait for it, and how long it is
+// held. Hold times fall into power-of-two buckets: bucket k counts holds of
+// less than 2^(k + LOCK_HOLD_SHIFT) nanoseconds, the last one the rest.
+#define LOCK_ARENA 0   // The arenas' locks
+#define LOCK_SLAB  1   // The slab size class locks
+#define LOCK_GROW  2   // The arenas' growth locks
+#define LOCK_LARGE 3   // The lock of the list of large objects
+#define LOCK_ZONE  4   // The lock of the slab zone
+#define NUM_LOCK_KINDS    5
+#define LOCK_HOLD_BUCKETS 16
+#define LOCK_HOLD_SHIFT   7
+
+typedef struct LockStats {
+    unsigned long _acquisitions;              // Times a lock of the kind was taken
+    unsigned long _contended;                 // Times the taker had to wait
+    unsigned long _waitNanos;                 // Time spent waiting
+    unsigned long _holdNanos;                 // Time the locks were held
+    unsigned long _holds[LOCK_HOLD_BUCKETS];  // Histogram of hold times
+} LockStats;
+
+typedef struct MallocStats {
+    unsigned long _mallocs;          // # malloc calls
+    unsigned long _frees;            // # free calls
+    unsigned long _reallocs;         // # realloc calls
+    unsigned long _reallocsInPlace;  // # realloc calls served without copying
+    unsigned long _callocs;          // # calloc calls
+    unsigned long _bytesAllocated;   // Usable bytes of every object handed out
+    unsigned long _bytesFreed;       // Usable bytes of every object given back
+    unsigned long _liveBytes;        // Usable bytes of the objects in use
+    unsigned long _allocations[STATS_SIZE_CLASSES];   // Objects handed out, per size class
+    unsigned long _deallocations[STATS_SIZE_CLASSES]; // Objects given back, per size class
+    unsigned long _lockContention;   // Times a thread found a heap lock taken
+    LockStats _locks[NUM_LOCK_KINDS]; // Per kind of lock, with MALLOCLOCKSTATS=YES only
+    int _arenas;                     // Number of arenas in use
+    size_t _heapSize;                // Same as the globals of the same name
+    size_t _largeSize;
+    size_t _slabSize;
+    size_t _purgedSize;
+} MallocStats;
+
+typedef struct StatsShard {
+    MallocStats _counts;             // Counted by the owning thread only
+    struct StatsShard *_next;        // List of every shard. Shards are never unmapped
+    struct StatsShard *_nextFree;    // List of shards of exited threads, ready for new threads
+} StatsShard;
+
+typedef struct ThreadCache {
+    ObjectHeader *_bins[NUM_SMALL_BINS]; // Cached chunks of each small bin size
+    int _counts[NUM_SMALL_BINS];         // Number of chunks in each list
+    void *_slabBins[NUM_SLAB_CLASSES];   // Cached slab slots of each class, chained through their first word
+    int _slabCounts[NUM_SLAB_CLASSES];   // Number of slots in each list
+    int _registered;                     // True once the exit destructor is armed
+} ThreadCache;
+
+// The heap profiler records the call stack of about one allocation per
+// _profileInterval bytes, picked at random, and keeps it until the object is
+// freed. Samples are found by address in a table of PROFILE_BUCKETS buckets.
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_BUCKETS   65536
+
+typedef struct ProfileSample {
+    void *_ptr;                       // The sampled object
+    size_t _size;                     // Bytes requested
+    int _depth;                       // Frames in _stack
+    void *_stack[PROFILE_MAX_DEPTH];  // Return addresses, innermost first
+    struct ProfileSample *_next;      // Next sample of the bucket, or of the free list
+} ProfileSample;
+
+typedef struct ProfileThread {
+    long _untilSample;                // Bytes the thread allocates before its next sample
+    unsigned long _random;            // State of the thread's random number generator
+    int _seeded;                      // True once _random and _untilSample are set up
+    int _busy;                        // True while recording, so the profiler's own allocations are not sampled
+} ProfileThread;
+
+// The trace recorder appends one TraceRecord per call to a file, through a
+// buffer of each thread. Objects are identified by the address they had when
+// the trace was recorded. Each thread's records have increasing times.
+#define TRACE_MALLOC   1
+#define TRACE_FREE     2
+#define TRACE_REALLOC  3
+#define TRACE_CALLOC   4
+#define TRACE_MEMALIGN 5
+#define TRACE_BUFFER_RECORDS 1024
+
+typedef struct TraceRecord {
+    unsigned long _time;              // Nanoseconds since the trace started
+    unsigned long _size;              // Bytes requested
+    unsigned long _ptr;               // Object allocated or freed
+    unsigned long _arg;               // Object resized by realloc, or alignment of memalign
+    unsigned int _thread;             // Number of the calling thread, from 1
+    unsigned int _op;                 // One of the TRACE_ constants
+} TraceRecord;
+
+typedef struct TraceBuffer {
+    int _used;                        // Records not yet written
+    unsigned int _thread;             // Number of the owning thread
+    unsigned long _lastTime;          // Time of the owner's last record
+    struct TraceBuffer *_nextFree;    // List of buffers of exited threads
+    TraceRecord _records[TRACE_BUFFER_RECORDS];
+} TraceBuffer;
+
+// A region hands out memory by bumping a pointer through 2MB chunks of its
+// own and gives it all back at once. The Region lives at the start of its
+// first chunk. Region memory is never passed to free or realloc.
+typedef struct RegionChunk {
+    struct RegionChunk *_next;        // Next chunk of the region
+    size_t _size;                     // Bytes mapped, a multiple of ARENA_SIZE
+} RegionChunk;
+
+typedef struct Region {
+    RegionChunk _first;               // The chunk the region itself lives in
+    RegionChunk *_current;            // Chunk being allocated from
+    char *_top;                       // Next free byte of _current
+    char *_end;                       // End of _current
+} Region;
+
 // STATE of the allocator
 
-size_t _heapSize;     // Size of the heap
+extern size_t _heapSize;     // Bytes of the heap mapped from the OS
+
+extern size_t _heapResident; // Bytes of the heap resident in RAM, as of the last print()
+
+extern int _retainChunks;    // Empty 2MB chunks an arena keeps instead of unmapping
+
+extern int _bestFit;         // True if large free chunks are picked best fit from the tree
 
-void *_memStart;      // initial memory pool
+extern int _addressOrder;    // True if the tree is ordered by address, and searched first fit (MALLOCFIT=ADDRESS)
 
-int _initialized;     // True if heap has been initialized
+extern int _deferCoalescing; // True if small objects wait in quick lists to be coalesced (MALLOCFIT=ADDRESS)
 
-int _verbose;         // Verbose mode
+extern int _remoteFree;      // True if frees from other arenas' threads are deferred to the owner
 
-int _mallocCalls;     // # malloc calls
+extern size_t _mmapThreshold; // Requests at least this large get their own mapping
 
-int _freeCalls;       // # free calls
+extern size_t _largeSize;    // Bytes mapped for objects that have their own mapping
 
-int _reallocCalls;    // # realloc calls
+extern int _slabsEnabled;    // True if small objects come from slabs
 
-int _callocCalls;     // # realloc calls
+extern int _hugePages;       // True if chunks and slabs ask for transparent huge pages
 
-ObjectHeader *_freeList;          // Free list
+extern int _lockStats;       // True if heap locks are timed (MALLOCLOCKSTATS=YES)
 
-ObjectHeader _freeListSentinel;   // Sentinel of free list
+extern char *_slabZone;      // Reserved address range that holds every slab
+
+extern size_t _slabSize;     // Bytes of the zone in use by slabs
+
+extern long _decayTime;      // Milliseconds a free run stays resident before decay purges it. 0 purges at once, negative never
+
+extern size_t _purgedSize;   // Bytes of free runs purged by decay so far
+
+extern size_t _profileInterval; // Mean bytes between samples. 0 if the profiler is off
+
+extern void *_memStart;      // initial memory pool
+
+extern int _initialized;     // True if heap has been initialized
+
+extern int _verbose;         // Verbose mode: 0 = off, 1 = on, 2 = also the allocator's own statistics
+
+extern Arena _arenas[MAX_ARENAS];  // Arenas of the heap
+
+extern int _numArenas;             // Number of arenas in use
 
 //FUNCTIONS
 
 void initialize(); //Initializes the heap
 
-void * allocateObject(size_t size); // Allocates an object 
+void * allocateObject(Arena * arena, size_t size); // Allocates an object from a locked arena
+
+size_t allocateObjects(Arena * arena, size_t size, size_t count, void ** ptrs); // Carves many objects from a locked arena at once
+
+void * allocateAlignedObject(Arena * arena, size_t alignment, size_t size); // Carves an aligned object from a locked arena
+
+void freeObject(void *ptr);         // Frees an object. Its arena must be locked
 
-void freeObject(void *ptr);         // Frees an object
+int reallocObject(ObjectHeader * header, size_t size); // Resizes an object without moving it. Its arena must be locked. Returns 0 if it cannot
+
+void * allocateLargeObject(size_t size, size_t alignment);  // Maps an object of its own
+
+void freeLargeObject(ObjectHeader * header); // Unmaps an object of its own
+
+void * reallocLargeObject(ObjectHeader * header, size_t size); // Resizes a mapping with mremap. Returns NULL on failure
 
 size_t objectSize(void *ptr);       // Returns the size of an object
 
@@ -50,23 +372,148 @@ void atExitHandler();               // At exit handler
 
 void print();         // Prints the current information about the allocator
 
+void stats_get(MallocStats * stats); // Sums up the statistics of every thread. Safe to call at any time
+
 void print_list();    // Prints the current state of the free list
 
+size_t malloc_batch(size_t size, size_t count, void **ptrs); // Allocates count objects of size bytes under one lock. Returns how many it got
+
+void free_batch(void **ptrs, size_t count); // Frees count objects under one lock per arena, coalescing neighbours first. Reorders ptrs
+
+void sizedFree(void *ptr, size_t size, size_t alignment); // Frees an object that operator new allocated for size bytes at alignment (0 for the default); sized operator delete
+
 void * getMemoryFromOS(size_t size); // Gets memory from the OS
 
+void releaseMemoryToOS(void *mem, size_t size); // Returns memory to the OS
+
+size_t residentBytes(); // Counts the bytes of the heap that are resident in RAM
+
+Arena * arena_get();   // Returns the calling thread's arena without locking it
+
+Arena * arena_lock();  // Returns the calling thread's arena, locked, with its remote frees drained
+
+int remote_free(Arena * arena, void * ptr); // Pushes an object onto its arena's remote frees if the calling thread uses another arena. Returns 0 if the caller must free it under the lock
+
+void arena_drain(Arena * arena); // Frees every object on a locked arena's remote frees
+
+Arena * arena_of(ObjectHeader * header); // Returns the arena that holds an object, NULL if it has its own mapping
+
 // Auxilary functions for allocateObject(..) and freeObject(..)
 
-// Traverses the freelist to return a pointer to a header that contains sufficient size, returns null otherwise
-ObjectHeader * fl_search(size_t size);
+// Returns the bin that a free chunk of the given size belongs in
+int fl_bin(size_t size);
+
+// Returns a pointer to a header that contains sufficient size, returns null otherwise. First fit takes the first chunk of the first non-empty bin that is guaranteed to fit; best fit takes the smallest chunk that fits, lowest address first
+ObjectHeader * fl_search(Arena * arena, size_t size);
 
-// Requests 2mb memory from the OS, sets up fenceposts and initial header, and returns a pointer to the initial header. As a side effect, it inserts that header to the beginning of the freelist
-ObjectHeader * fl_create();
+// Requests 2mb memory from the OS for an arena, sets up fenceposts and initial header, and returns a pointer to the initial header. As a side effect, it inserts that header into the arena's bins. The arena's lock is dropped meanwhile, so it returns a free chunk of at least size bytes that another thread added instead if there is one
+ObjectHeader * fl_create(Arena * arena, size_t size);
 
-// Splits a chunk of memory. Establishes a new header to the right of chunk, updates its and chunk's fields, and returns a pointer to the new header.
+// Splits a free chunk of memory. Establishes a new header to the right of chunk, updates its and chunk's fields and footers, and returns a pointer to the new header.
 ObjectHeader * split_chunk(ObjectHeader * chunk, size_t size);
 
-// Removes an ObjectHeader from the freelist
+// Removes an ObjectHeader from its arena's bin. Must be called before the header's size changes
 void fl_remove(ObjectHeader * header);
 
-// Insert an ObjectHeader into the beginning of the freelist
+// Insert an ObjectHeader into the beginning of its arena's bin for its size
 void fl_insert(ObjectHeader * header);
+
+// Called on a free chunk that spans a whole 2MB chunk. Unmaps the chunk if the arena already retains enough empty chunks
+void fl_release(ObjectHeader * header);
+
+// Quick list functions. The arena must be locked.
+
+// Pushes a freed object onto its arena's quick list for its size
+void quick_push(ObjectHeader * header);
+
+// Pops an object of exactly size bytes from the arena's quick lists. Returns null if there is none
+ObjectHeader * quick_pop(Arena * arena, size_t size);
+
+// Coalesces every object of the arena's quick lists into the bins. Returns 0 if there was none
+int quick_sweep(Arena * arena);
+
+// Slab functions. Each size class of an arena has a lock of its own, which they take themselves.
+
+// Returns the size class of a slab object of the given size
+int slab_class(size_t size);
+
+// Returns the slot size of a size class
+size_t slab_size(int slabClass);
+
+// True if ptr is a slab object
+int is_slab(void * ptr);
+
+// Takes up to count free slots of the size class from the arena's slabs, creating slabs if needed. Returns how many it took, fewer if the zone is full
+int slab_allocate(Arena * arena, int slabClass, void ** slots, int count);
+
+// Marks a slot free. Gives the slab back to the zone if it is empty and not the last of its class
+void slab_free(void * ptr);
+
+// Page map functions. Lookups never lock; entries change only for pages that are mapped or about to be unmapped.
+
+// Enters every page of [start, start + size) with owner and its kind, or removes them if owner is null. Returns 0 if the OS cannot spare a node of the tree
+int pagemap_set(void * start, size_t size, void * owner, int kind);
+
+// Returns the entry of the page that holds ptr, 0 if the allocator does not own it
+unsigned long pagemap_get(void * ptr);
+
+// Heap profiler functions. None of them are called with a heap lock held.
+
+// Starts sampling about one allocation per interval bytes, or stops sampling new allocations if interval is 0
+void profile_start(size_t interval);
+
+// Counts an allocation against the calling thread's sampling budget and records its call stack if it is picked
+void profile_allocated(void * ptr, size_t size);
+
+// Forgets an object if it was sampled
+void profile_freed(void * ptr);
+
+// Writes the live samples as a heap profile that pprof reads, to path or to a new file named after MALLOCPROFILEFILE if path is null. Returns 0 on failure
+int profile_dump(const char * path);
+
+// Region functions. A region belongs to one thread at a time.
+
+// Maps the first chunk of a new region. Returns null if the OS is out of memory
+Region * region_create();
+
+// Bumps size bytes off the region, mapping another chunk if the current one is full. Returns null if the OS is out of memory
+void * region_alloc(Region * region, size_t size);
+
+// Frees everything allocated from the region in constant time. Its chunks stay mapped for reuse
+void region_reset(Region * region);
+
+// Unmaps every chunk of the region, including the one the region lives in
+void region_destroy(Region * region);
+
+// Trace recorder functions. None of them are called with a heap lock held.
+
+// Starts appending the records of every thread to path. Returns 0 if the file cannot be created
+int trace_start(const char * path);
+
+// Records a call, buffered by the calling thread
+void trace_record(unsigned int op, size_t size, void * ptr, unsigned long arg);
+
+// Writes the calling thread's buffered records to the trace
+void trace_flush();
+
+// Decay functions
+
+// Starts the thread that purges free runs once they are older than the decay time, unless it runs already
+void decay_start();
+
+// Gives back the pages of the locked arena's free runs that were freed at least three epochs before epoch
+void decay_purge(Arena * arena, unsigned long epoch);
+
+// Thread cache functions. None of them are called with the heap lock held.
+
+// Pops a cached object for size, refilling the cache from the heap in a batch if needed. Returns null if size is too large to cache
+void * tc_allocate(size_t size);
+
+// Pushes a slab object of the size class onto the cache, flushing half of the list if it is full
+void tc_free_slab(void * ptr, int slabClass);
+
+// Pushes a small object onto the cache, flushing half of the list to the heap if it is full. Returns 0 if the object is too large to cache
+int tc_free(void * ptr);
+
+// Returns every chunk in the cache to the heap
+void tc_flush(ThreadCache * cache);
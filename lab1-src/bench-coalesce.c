@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "MyMalloc.h"
+
+// Runs test7's pattern many times over -- allocate a batch, free the even
+// objects, then the odd ones, allocate again -- with mixed sizes and some
+// objects kept alive across rounds, so that the holes do not all coalesce.
+// Best fit with eager coalescing is compared with MALLOCFIT=ADDRESS, which
+// orders the tree of large free chunks by address and defers coalescing
+// small objects. The exact bins stay LIFO under both.
+// Slabs are off, or they would take most of these sizes from the bins.
+
+#define allocations 50000
+#define rounds 40
+#define kept 10000
+
+size_t randomSize(unsigned int *seed){
+    // Mostly test7's 100 bytes, some other small sizes, now and then a
+    // medium one
+    int r = rand_r(seed) % 100;
+    if (r < 50)
+        return 100;
+    if (r < 95)
+        return 16 + rand_r(seed) % 240;
+    return 256 + rand_r(seed) % 4096;
+}
+
+char *ptrs[allocations];
+char *keep[kept];
+
+void runRounds(){
+    unsigned int seed = 252;
+    size_t peak = 0, peakResident = 0;
+    long calls = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int r, i;
+    for(r=0;r<rounds;r++){
+        for(i=0;i<allocations;i++){
+            ptrs[i] = (char *) malloc(randomSize(&seed));
+            *ptrs[i] = 100;
+            // Now and then an object outlives the round
+            if (i % 50 == 0) {
+                int k = rand_r(&seed) % kept;
+                free(keep[k]);
+                keep[k] = (char *) malloc(randomSize(&seed));
+                calls += 2;
+            }
+        }
+        if (_heapSize > peak)
+            peak = _heapSize;
+        size_t resident = residentBytes();
+        if (resident > peakResident)
+            peakResident = resident;
+        for(i=0;i<allocations;i+=2){
+            free(ptrs[i]);
+        }
+        for(i=1;i<allocations;i+=2){
+            free(ptrs[i]);
+        }
+        calls += 2 * allocations;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%8s %16.0f %16zu %16zu\n", _deferCoalescing ? "address" : "best", calls / seconds,
+           peak, peakResident);
+    for(i=0;i<kept;i++){
+        free(keep[i]);
+    }
+}
+
+int main(int argc, char **argv){
+    if (argc > 1 && !strcmp(argv[1], "--run")) {
+        runRounds();
+        exit(0);
+    }
+
+    printf("\n---- Running bench-coalesce ---\n");
+    printf("%8s %16s %16s %16s\n", "policy", "calls/sec", "peak heap", "peak resident");
+    fflush(stdout);
+
+    const char *policies[] = { "BEST", "ADDRESS" };
+    int i;
+    for(i=0;i<2;i++){
+        pid_t pid = fork();
+        if (pid == 0) {
+            setenv("MALLOCFIT", policies[i], 1);
+            setenv("MALLOCSLABS", "NO", 1);
+            setenv("MALLOCVERBOSE", "NO", 1);
+            execl(argv[0], argv[0], "--run", (char *) NULL);
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    exit(0);
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "MyMalloc.h"
+
+// Replays the same random trace of medium-sized allocations with first fit
+// and with best fit, and compares the peak heap size of the two. Each policy
+// runs in a fresh process, since MALLOCFIT is read when the heap starts up.
+
+#define window 4000
+
+int operations = 400000;
+
+size_t randomSize(unsigned int *seed){
+    // Mostly small-to-medium objects with the odd big one, so that the
+    // holes left behind come in many sizes
+    int r = rand_r(seed) % 100;
+    if (r < 60)
+        return 512 + rand_r(seed) % 2048;
+    if (r < 90)
+        return 2560 + rand_r(seed) % 8192;
+    return 10752 + rand_r(seed) % 65536;
+}
+
+void runTrace(){
+    char *live[window] = { 0 };
+    unsigned int seed = 252;
+    size_t peak = 0, requested = 0, peakRequested = 0;
+    size_t sizes[window] = { 0 };
+    int i;
+    for(i=0;i<operations;i++){
+        int slot = rand_r(&seed) % window;
+        if (live[slot]) {
+            free(live[slot]);
+            requested -= sizes[slot];
+        }
+        sizes[slot] = randomSize(&seed);
+        live[slot] = (char *) malloc(sizes[slot]);
+        *live[slot] = 100;
+        requested += sizes[slot];
+        if (requested > peakRequested)
+            peakRequested = requested;
+        if (_heapSize > peak)
+            peak = _heapSize;
+    }
+    printf("%8s %16zu %16zu %15.1f%%\n", _bestFit ? "best" : "first", peak, peakRequested,
+           100.0 * (peak - peakRequested) / peak);
+    for(i=0;i<window;i++){
+        free(live[i]);
+    }
+}
+
+int main(int argc, char **argv){
+    if (argc > 1 && !strcmp(argv[1], "--run")) {
+        runTrace();
+        exit(0);
+    }
+
+    printf("\n---- Running bench-frag ---\n");
+    printf("%8s %16s %16s %16s\n", "fit", "peak heap", "peak requested", "overhead");
+    fflush(stdout);
+
+    const char *policies[] = { "FIRST", "BEST" };
+    int i;
+    for(i=0;i<2;i++){
+        pid_t pid = fork();
+        if (pid == 0) {
+            setenv("MALLOCFIT", policies[i], 1);
+            setenv("MALLOCVERBOSE", "NO", 1);
+            execl(argv[0], argv[0], "--run", (char *) NULL);
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    exit(0);
+}
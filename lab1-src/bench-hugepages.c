@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include "MyMalloc.h"
+
+// Chases pointers through a list of small objects linked in random order,
+// once with 4KB pages and once with MALLOCHUGEPAGES=YES. Each run is a fresh
+// process, since the mode is read when the heap starts up. dTLB load misses
+// come from perf counters when the kernel lets us open them.
+
+#define nodes 2000000
+#define passes 4
+
+typedef struct Node {
+    struct Node *next;
+    long payload[3];
+} Node;
+
+static int openCounter(){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Kilobytes of the heap backed by huge pages, or -1 if the kernel does not say
+static long hugeKilobytes(){
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL)
+        return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// Keeps the chase from being optimized away
+Node * volatile lastNode;
+
+void runChase(){
+    Node **order = (Node **) malloc(nodes * sizeof(Node *));
+    unsigned int seed = 252;
+    int i;
+    for(i=0;i<nodes;i++){
+        order[i] = (Node *) malloc(sizeof(Node));
+    }
+    for(i=nodes-1;i>0;i--){
+        int j = rand_r(&seed) % (i + 1);
+        Node *tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for(i=0;i<nodes;i++){
+        order[i]->next = order[(i + 1) % nodes];
+    }
+
+    int counter = openCounter();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Node *curr = order[0];
+    long steps;
+    for(steps=0;steps<(long)nodes*passes;steps++){
+        curr = curr->next;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    lastNode = curr;
+
+    char misses[32] = "n/a";
+    long long count;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &count, sizeof(count)) == sizeof(count))
+            snprintf(misses, sizeof(misses), "%lld", count);
+        close(counter);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%8s %16.0f %16s %16ld\n", _hugePages ? "huge" : "4KB",
+           steps / seconds, misses, hugeKilobytes());
+
+    for(i=0;i<nodes;i++){
+        free(order[i]);
+    }
+    free(order);
+}
+
+int main(int argc, char **argv){
+    if (argc > 1 && !strcmp(argv[1], "--run")) {
+        runChase();
+        exit(0);
+    }
+
+    printf("\n---- Running bench-hugepages ---\n");
+    printf("%8s %16s %16s %16s\n", "pages", "loads/sec", "dTLB misses", "huge KB");
+    fflush(stdout);
+
+    const char *modes[] = { "NO", "YES" };
+    int i;
+    for(i=0;i<2;i++){
+        pid_t pid = fork();
+        if (pid == 0) {
+            setenv("MALLOCHUGEPAGES", modes[i], 1);
+            setenv("MALLOCVERBOSE", "NO", 1);
+            execl(argv[0], argv[0], "--run", (char *) NULL);
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    exit(0);
+}
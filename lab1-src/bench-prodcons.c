@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "MyMalloc.h"
+
+// test6 as a pipeline: in each pair of threads the producer mallocs buffers
+// and hands them to the consumer through a ring, and the consumer frees
+// them. The run is repeated with remote frees on and off, each in a fresh
+// process, since MALLOCREMOTEFREE is read when the heap starts up.
+
+#define ringSize 1024
+
+int buffersPerPair = 1000000;
+
+typedef struct Ring {
+    char *slots[ringSize];
+    unsigned long head;       // Next slot the producer fills
+    unsigned long tail;       // Next slot the consumer empties
+} Ring;
+
+void *producerThread(void *arg){
+    Ring *ring = (Ring *) arg;
+    int i;
+    for(i=0;i<buffersPerPair;i++){
+        // Sizes cover slabs, cached chunks and chunks from the bins
+        char *buffer = (char *) malloc(32 + (i % 64) * 32);
+        *buffer = 100;
+        unsigned long head = ring->head;
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ringSize)
+            sched_yield();
+        ring->slots[head % ringSize] = buffer;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void *consumerThread(void *arg){
+    Ring *ring = (Ring *) arg;
+    int i;
+    for(i=0;i<buffersPerPair;i++){
+        unsigned long tail = ring->tail;
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+            sched_yield();
+        free(ring->slots[tail % ringSize]);
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void runPairs(int numPairs){
+    pthread_t threads[2 * numPairs];
+    Ring *rings = (Ring *) calloc(numPairs, sizeof(Ring));
+    double start = now();
+    int i;
+    for(i=0;i<numPairs;i++){
+        pthread_create(&threads[2 * i], NULL, producerThread, &rings[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumerThread, &rings[i]);
+    }
+    for(i=0;i<2 * numPairs;i++){
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    free(rings);
+
+    // Each buffer is one malloc and one free
+    double ops = 2.0 * buffersPerPair * numPairs / elapsed;
+    printf("%8s %8d %16.0f\n", _remoteFree ? "on" : "off", numPairs, ops);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv){
+    int maxPairs = argc > 1 ? atoi(argv[1]) : 4;
+    if (argc > 2)
+        buffersPerPair = atoi(argv[2]);
+
+    if (argc > 3 && !strcmp(argv[3], "--run")) {
+        int numPairs;
+        for(numPairs=1;numPairs<=maxPairs;numPairs*=2){
+            runPairs(numPairs);
+        }
+        exit(0);
+    }
+
+    printf("\n---- Running bench-prodcons ---\n");
+    printf("%8s %8s %16s\n", "remote", "pairs", "ops/sec");
+    fflush(stdout);
+
+    const char *settings[] = { "NO", "YES" };
+    char pairs[16], buffers[16];
+    snprintf(pairs, sizeof(pairs), "%d", maxPairs);
+    snprintf(buffers, sizeof(buffers), "%d", buffersPerPair);
+    int i;
+    for(i=0;i<2;i++){
+        pid_t pid = fork();
+        if (pid == 0) {
+            setenv("MALLOCREMOTEFREE", settings[i], 1);
+            setenv("MALLOCVERBOSE", "NO", 1);
+            execl(argv[0], argv[0], pairs, buffers, "--run", (char *) NULL);
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    exit(0);
+}
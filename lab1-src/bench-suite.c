@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Allocator stress patterns, run against the system malloc and against
+// MyMalloc.so through LD_PRELOAD. This file does not link MyMalloc.c, so
+// whichever malloc the dynamic linker picks is the one measured.
+//
+// Every pattern, allocator and thread count runs in a process of its own,
+// so that the peak RSS reported is that run's alone. One call in every
+// latencyEvery is timed on its own for the latency percentiles.
+//
+// usage: bench-suite [maxThreads [scale [pattern]]]
+
+#define latencyEvery   16
+#define maxLatencies   (1 << 16)
+
+typedef struct Pattern {
+    const char *name;
+    void *(*thread)(void *);
+} Pattern;
+
+typedef struct Worker {
+    int index;                 // Position among the run's threads
+    unsigned int seed;         // State of rand_r
+    unsigned long ops;         // Allocator calls made
+    unsigned int *latencies;   // Nanoseconds of the timed calls
+    int numLatencies;
+    unsigned long tick;        // Calls since the last timed one
+} Worker;
+
+int numThreads;
+int scale = 1;
+pthread_barrier_t barrier;
+Worker *workers;
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long nowNanos(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// The calls every pattern makes, counted and now and then timed
+
+int timeThisCall(Worker *w){
+    w->ops++;
+    return ++w->tick % latencyEvery == 0 && w->numLatencies < maxLatencies;
+}
+
+void *timedMalloc(Worker *w, size_t size){
+    if (!timeThisCall(w))
+        return malloc(size);
+    long start = nowNanos();
+    void *ptr = malloc(size);
+    w->latencies[w->numLatencies++] = nowNanos() - start;
+    return ptr;
+}
+
+void timedFree(Worker *w, void *ptr){
+    if (!timeThisCall(w)) {
+        free(ptr);
+        return;
+    }
+    long start = nowNanos();
+    free(ptr);
+    w->latencies[w->numLatencies++] = nowNanos() - start;
+}
+
+void *timedRealloc(Worker *w, void *ptr, size_t size){
+    if (!timeThisCall(w))
+        return realloc(ptr, size);
+    long start = nowNanos();
+    void *newptr = realloc(ptr, size);
+    w->latencies[w->numLatencies++] = nowNanos() - start;
+    return newptr;
+}
+
+// larson: server churn. Each thread replaces random objects of a set of
+// random sizes; after every round the sets move on to the next thread, so
+// most frees are of objects another thread allocated.
+
+#define larsonSlots  1000
+#define larsonRounds 20
+
+char **larsonSets;
+
+void *larsonThread(void *arg){
+    Worker *w = (Worker *) arg;
+    int round, i;
+    for(round=0;round<larsonRounds;round++){
+        char **set = &larsonSets[((w->index + round) % numThreads) * larsonSlots];
+        for(i=0;i<5000 * scale;i++){
+            int slot = rand_r(&w->seed) % larsonSlots;
+            if (set[slot])
+                timedFree(w, set[slot]);
+            size_t size = 16 + rand_r(&w->seed) % 1008;
+            set[slot] = (char *) timedMalloc(w, size);
+            *set[slot] = 100;
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+// threadtest: every thread allocates a batch of same-sized objects and
+// frees them all, over and over.
+
+#define threadtestBatch 1000
+
+void *threadtestThread(void *arg){
+    Worker *w = (Worker *) arg;
+    char *batch[threadtestBatch];
+    int round, i;
+    for(round=0;round<100 * scale;round++){
+        for(i=0;i<threadtestBatch;i++){
+            batch[i] = (char *) timedMalloc(w, 64);
+            *batch[i] = 100;
+        }
+        for(i=0;i<threadtestBatch;i++){
+            timedFree(w, batch[i]);
+        }
+    }
+    return NULL;
+}
+
+// prodcons: threads pair up; the even one mallocs buffers and passes them
+// through a ring to the odd one, which frees them. A thread left without a
+// partner frees its own buffers.
+
+#define ringSize 1024
+
+typedef struct Ring {
+    char *slots[ringSize];
+    unsigned long head;
+    unsigned long tail;
+} Ring;
+
+Ring *rings;
+
+void *prodconsThread(void *arg){
+    Worker *w = (Worker *) arg;
+    Ring *ring = &rings[w->index / 2];
+    int i;
+    int buffers = 100000 * scale;
+    if (w->index % 2 == 0 && w->index + 1 == numThreads) {
+        for(i=0;i<buffers;i++){
+            char *buffer = (char *) timedMalloc(w, 32 + rand_r(&w->seed) % 2048);
+            *buffer = 100;
+            timedFree(w, buffer);
+        }
+    } else if (w->index % 2 == 0) {
+        for(i=0;i<buffers;i++){
+            char *buffer = (char *) timedMalloc(w, 32 + rand_r(&w->seed) % 2048);
+            *buffer = 100;
+            unsigned long head = ring->head;
+            while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ringSize)
+                sched_yield();
+            ring->slots[head % ringSize] = buffer;
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for(i=0;i<buffers;i++){
+            unsigned long tail = ring->tail;
+            while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+                sched_yield();
+            timedFree(w, ring->slots[tail % ringSize]);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+// realloc: each thread grows and shrinks a set of buffers to random sizes,
+// checking that their contents survive.
+
+#define reallocSlots 64
+
+void *reallocThread(void *arg){
+    Worker *w = (Worker *) arg;
+    char *buffers[reallocSlots] = { 0 };
+    size_t sizes[reallocSlots] = { 0 };
+    int i;
+    for(i=0;i<50000 * scale;i++){
+        int slot = rand_r(&w->seed) % reallocSlots;
+        size_t size = 1 + rand_r(&w->seed) % 65536;
+        buffers[slot] = (char *) timedRealloc(w, buffers[slot], size);
+        if (sizes[slot] && buffers[slot][0] != (char) slot) {
+            fprintf(stderr, "realloc lost the contents of slot %d\n", slot);
+            exit(1);
+        }
+        buffers[slot][0] = (char) slot;
+        buffers[slot][size - 1] = (char) slot;
+        sizes[slot] = size;
+    }
+    for(i=0;i<reallocSlots;i++){
+        timedFree(w, buffers[i]);
+    }
+    return NULL;
+}
+
+// fragtrace: phases that leave the heap fragmented. Many small objects, most
+// of them freed at random, then bigger objects that only fit in the holes if
+// they were coalesced, then everything freed. Peak RSS shows how much of
+// the fragmented heap the allocator could reuse.
+
+#define fragObjects 20000
+
+void *fragThread(void *arg){
+    Worker *w = (Worker *) arg;
+    char **small = (char **) mmap(NULL, fragObjects * sizeof(char *), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char **big = (char **) mmap(NULL, fragObjects * sizeof(char *), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int round, i;
+    for(round=0;round<scale * 2;round++){
+        for(i=0;i<fragObjects;i++){
+            small[i] = (char *) timedMalloc(w, 16 + rand_r(&w->seed) % 240);
+            *small[i] = 100;
+        }
+        for(i=0;i<fragObjects;i++){
+            if (rand_r(&w->seed) % 4 != 0) {
+                timedFree(w, small[i]);
+                small[i] = NULL;
+            }
+        }
+        for(i=0;i<fragObjects / 4;i++){
+            big[i] = (char *) timedMalloc(w, 256 + rand_r(&w->seed) % 768);
+            *big[i] = 100;
+        }
+        for(i=0;i<fragObjects;i++){
+            if (small[i])
+                timedFree(w, small[i]);
+        }
+        for(i=0;i<fragObjects / 4;i++){
+            timedFree(w, big[i]);
+        }
+    }
+    munmap(small, fragObjects * sizeof(char *));
+    munmap(big, fragObjects * sizeof(char *));
+    return NULL;
+}
+
+Pattern patterns[] = {
+    { "larson", larsonThread },
+    { "threadtest", threadtestThread },
+    { "prodcons", prodconsThread },
+    { "realloc", reallocThread },
+    { "fragtrace", fragThread },
+};
+int numPatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+int compareLatencies(const void *a, const void *b){
+    unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+    return x < y ? -1 : x > y;
+}
+
+void runPattern(Pattern *pattern){
+    workers = (Worker *) mmap(NULL, numThreads * sizeof(Worker), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    unsigned int *latencies = (unsigned int *) mmap(NULL, numThreads * maxLatencies * sizeof(unsigned int),
+                                                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    larsonSets = (char **) mmap(NULL, numThreads * larsonSlots * sizeof(char *), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    rings = (Ring *) mmap(NULL, (numThreads / 2 + 1) * sizeof(Ring), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pthread_barrier_init(&barrier, NULL, numThreads);
+
+    pthread_t threads[numThreads];
+    int i;
+    for(i=0;i<numThreads;i++){
+        workers[i].index = i;
+        workers[i].seed = 252 + i;
+        workers[i].latencies = latencies + i * maxLatencies;
+    }
+
+    double start = now();
+    for(i=0;i<numThreads;i++){
+        pthread_create(&threads[i], NULL, pattern->thread, &workers[i]);
+    }
+    for(i=0;i<numThreads;i++){
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // The timed calls of all threads, packed together and sorted
+    unsigned long ops = 0;
+    int numLatencies = 0;
+    for(i=0;i<numThreads;i++){
+        ops += workers[i].ops;
+        memmove(latencies + numLatencies, workers[i].latencies,
+                workers[i].numLatencies * sizeof(unsigned int));
+        numLatencies += workers[i].numLatencies;
+    }
+    qsort(latencies, numLatencies, sizeof(unsigned int), compareLatencies);
+    unsigned int p50 = numLatencies ? latencies[numLatencies / 2] : 0;
+    unsigned int p99 = numLatencies ? latencies[(long) numLatencies * 99 / 100] : 0;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%-9s %-11s %7d %14.0f %9u %9u %12ld\n",
+           getenv("LD_PRELOAD") ? "mymalloc" : "glibc", pattern->name, numThreads,
+           ops / elapsed, p50, p99, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv){
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 4;
+    if (argc > 2)
+        scale = atoi(argv[2]);
+    const char *only = argc > 3 ? argv[3] : NULL;
+
+    if (argc > 5 && !strcmp(argv[4], "--run")) {
+        numThreads = maxThreads;
+        runPattern(&patterns[atoi(argv[5])]);
+        exit(0);
+    }
+
+    // MyMalloc.so is looked for next to this program unless MALLOCLIB says
+    // where it is
+    char library[PATH_MAX];
+    const char *envlib = getenv("MALLOCLIB");
+    if (envlib == NULL) {
+        char self[PATH_MAX];
+        strncpy(self, argv[0], sizeof(self) - 1);
+        self[sizeof(self) - 1] = 0;
+        char *slash = strrchr(self, '/');
+        snprintf(library, sizeof(library), "%s/MyMalloc.so", slash ? (*slash = 0, self) : ".");
+        envlib = library;
+    }
+    char resolved[PATH_MAX];
+    if (realpath(envlib, resolved) == NULL) {
+        fprintf(stderr, "bench-suite: cannot find %s\n", envlib);
+        exit(1);
+    }
+
+    printf("\n---- Running bench-suite ---\n");
+    printf("%-9s %-11s %7s %14s %9s %9s %12s\n",
+           "malloc", "pattern", "threads", "ops/sec", "p50 ns", "p99 ns", "peak RSS KB");
+    fflush(stdout);
+
+    char threadArg[16], scaleArg[16], patternArg[16];
+    snprintf(scaleArg, sizeof(scaleArg), "%d", scale);
+    int p, t, useMyMalloc;
+    for(p=0;p<numPatterns;p++){
+        if (only && strcmp(only, patterns[p].name))
+            continue;
+        snprintf(patternArg, sizeof(patternArg), "%d", p);
+        for(t=1;t<=maxThreads;t*=2){
+            snprintf(threadArg, sizeof(threadArg), "%d", t);
+            for(useMyMalloc=0;useMyMalloc<2;useMyMalloc++){
+                pid_t pid = fork();
+                if (pid == 0) {
+                    if (useMyMalloc) {
+                        setenv("LD_PRELOAD", resolved, 1);
+                        setenv("MALLOCVERBOSE", "NO", 1);
+                    } else {
+                        unsetenv("LD_PRELOAD");
+                    }
+                    execl(argv[0], argv[0], threadArg, scaleArg, patterns[p].name,
+                          "--run", patternArg, (char *) NULL);
+                    exit(1);
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    printf("%-9s %-11s %7d failed\n", useMyMalloc ? "mymalloc" : "glibc",
+                           patterns[p].name, t);
+                }
+            }
+        }
+    }
+    exit(0);
+}
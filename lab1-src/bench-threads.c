@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include "MyMalloc.h"
+
+// test6 scaled up: every thread runs a malloc/free loop over a small window
+// of live objects, and the run is repeated for 1, 2, 4, ... maxThreads.
+
+#define window 64
+
+int opsPerThread = 1000000;
+
+void *allocationThread(void *none){
+    char *live[window] = { 0 };
+    int i;
+    for(i=0;i<opsPerThread;i++){
+        int slot = i % window;
+        if (live[slot])
+            free(live[slot]);
+        live[slot] = (char *) malloc(10 + (i % 7) * 8);
+        *live[slot] = 100;
+    }
+    for(i=0;i<window;i++){
+        free(live[i]);
+    }
+    return NULL;
+}
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv){
+    printf("\n---- Running bench-threads ---\n");
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 16;
+    if (argc > 2)
+        opsPerThread = atoi(argv[2]);
+
+    printf("%8s %16s %16s\n", "threads", "ops/sec", "ops/sec/thread");
+    int numThreads;
+    for(numThreads=1;numThreads<=maxThreads;numThreads*=2){
+        pthread_t threads[numThreads];
+        double start = now();
+        int i;
+        for(i=0;i<numThreads;i++){
+            pthread_create(&threads[i],NULL,allocationThread,NULL);
+        }
+        for(i=0;i<numThreads;i++){
+            pthread_join(threads[i],NULL);
+        }
+        double elapsed = now() - start;
+
+        // Each iteration is one malloc and one free
+        double ops = 2.0 * opsPerThread * numThreads / elapsed;
+        printf("%8d %16.0f %16.0f\n", numThreads, ops, ops / numThreads);
+    }
+    exit(0);
+}
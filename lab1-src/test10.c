@@ -0,0 +1,43 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "MyMalloc.h"
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test10 ---\n");
+  printf("Grow and shrink with realloc\n");
+
+  //grow a vector one element at a time; the chunk to its right is free
+  int * vec = NULL;
+  MallocStats stats;
+  int i;
+  for (i = 0; i < 10000; i++ ) {
+    vec = (int *) realloc( vec, (i + 1) * sizeof(int) );
+    vec[i] = i;
+  }
+  for (i = 0; i < 10000; i++ ) {
+    if (vec[i] != i) {
+      printf("realloc lost element %d\n", i);
+      exit(1);
+    }
+  }
+  stats_get(&stats);
+  printf("%lu of %lu reallocs in place\n", stats._reallocsInPlace, stats._reallocs);
+
+  //shrink back, the tail goes back to the free list
+  vec = (int *) realloc( vec, 8 * sizeof(int) );
+  if (vec[7] != 7) {
+    printf("realloc lost element 7\n");
+    exit(1);
+  }
+  stats_get(&stats);
+  printf("%lu of %lu reallocs in place\n", stats._reallocsInPlace, stats._reallocs);
+
+  free(vec);
+  print_list();
+
+  exit(0);
+}
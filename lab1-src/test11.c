@@ -0,0 +1,55 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "MyMalloc.h"
+
+int
+check_zero( char * mem, size_t size )
+{
+  size_t i;
+  for (i = 0; i < size; i++ ) {
+    if (mem[i] != 0) {
+      printf("byte %zd is not zero\n", i);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test11 ---\n");
+  printf("calloc on fresh and reused memory\n");
+
+  //fresh memory from the OS
+  char * mem1 = (char *) calloc( 100, 10 );
+  char * mem2 = (char *) calloc( 1, 1048576 );
+  if (!check_zero(mem1, 1000) || !check_zero(mem2, 1048576))
+    exit(1);
+  printf("fresh callocs are zero\n");
+
+  //dirty them, free them, and get the same memory back
+  memset(mem1, 0xff, 1000);
+  free(mem1);
+  mem1 = (char *) calloc( 1000, 1 );
+  if (!check_zero(mem1, 1000))
+    exit(1);
+  printf("reused calloc is zero\n");
+
+  //nelem * elsize overflows
+  volatile size_t nelem = SIZE_MAX / 2;
+  char * mem3 = (char *) calloc( nelem, 4 );
+  if (mem3 != NULL) {
+    printf("overflowing calloc did not fail\n");
+    exit(1);
+  }
+  printf("overflowing calloc returns NULL\n");
+
+  free(mem1);
+  free(mem2);
+  exit(0);
+}
@@ -0,0 +1,48 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "MyMalloc.h"
+
+#define count 20000
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test12 ---\n");
+  printf("Small objects come from slabs\n");
+
+  //one object of every small size, many times over
+  char * ptrs[count];
+  int i;
+  for (i = 0; i < count; i++ ) {
+    size_t size = 1 + i % SLAB_MAX_SIZE;
+    ptrs[i] = (char *) malloc( size );
+    memset(ptrs[i], i & 0xff, size);
+  }
+
+  for (i = 0; i < count; i++ ) {
+    size_t size = 1 + i % SLAB_MAX_SIZE;
+    if (!is_slab(ptrs[i]) || SLAB_OF(ptrs[i])->_objectSize < size) {
+      printf("object %d is not in a big enough slab slot\n", i);
+      exit(1);
+    }
+    if ((unsigned long) ptrs[i] & (OBJECT_ALIGN - 1)) {
+      printf("object %d of %zd bytes is at %p\n", i, size, ptrs[i]);
+      exit(1);
+    }
+    if (ptrs[i][0] != (char)(i & 0xff) || ptrs[i][size - 1] != (char)(i & 0xff)) {
+      printf("object %d was overwritten\n", i);
+      exit(1);
+    }
+  }
+  printf("%d objects in %zd bytes of slabs\n", count, _slabSize);
+
+  for (i = 0; i < count; i++ ) {
+    free(ptrs[i]);
+  }
+  print_list();
+
+  exit(0);
+}
@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "MyMalloc.h"
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test13 ---\n");
+  printf("Best fit among large free chunks\n");
+
+  //leave three holes of different sizes, each fenced off by another object
+  char * hole1 = (char *) malloc( 1000 );
+  char * fence1 = (char *) malloc( 600 );
+  char * hole2 = (char *) malloc( 600 );
+  char * fence2 = (char *) malloc( 600 );
+  char * hole3 = (char *) malloc( 800 );
+  char * fence3 = (char *) malloc( 600 );
+  free(hole1);
+  free(hole2);
+  free(hole3);
+  print_list();
+
+  //first fit would take the 800 byte hole, the first one in a bin that fits,
+  //and address order the lowest chunk that fits
+  char * mem = (char *) malloc( 584 );
+  printf("mem = malloc(584)\n");
+  print_list();
+  if (_bestFit && !_addressOrder && mem != hole2) {
+    printf("malloc(584) did not take the 600 byte hole\n");
+    exit(1);
+  }
+
+  free(mem);
+  free(fence1);
+  free(fence2);
+  free(fence3);
+  print_list();
+
+  exit(0);
+}
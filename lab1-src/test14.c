@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "MyMalloc.h"
+
+#define numThreads 4
+#define allocsPerThread 1000
+
+void *allocationThread(void *none){
+    int i;
+    for(i=0;i<allocsPerThread;i++){
+        char * p1 = (char *) malloc(100);
+        *p1 = 100;
+        free(p1);
+    }
+    return NULL;
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test14 ---\n");
+  printf("Statistics of live and exited threads\n");
+
+  MallocStats before, after;
+  stats_get(&before);
+
+  //objects that stay live are counted in live bytes
+  char * mem1 = (char *) malloc( 1000 );
+  char * mem2 = (char *) malloc( 100000 );
+  stats_get(&after);
+  if (after._mallocs - before._mallocs != 2 ||
+      after._liveBytes - before._liveBytes < 101000) {
+    printf("malloc not counted\n");
+    exit(1);
+  }
+  if (after._allocations[10] - before._allocations[10] != 1 ||
+      after._allocations[17] - before._allocations[17] != 1) {
+    printf("size classes not counted\n");
+    exit(1);
+  }
+
+  //the counts of threads that exited are kept. Creating a thread may
+  //allocate too, so there may be more calls than the threads made
+  pthread_t threads[numThreads];
+  int i;
+  for(i=0;i<numThreads;i++){
+    pthread_create(&threads[i],NULL,allocationThread,NULL);
+  }
+  for(i=0;i<numThreads;i++){
+    pthread_join(threads[i],NULL);
+  }
+  stats_get(&after);
+  if (after._mallocs - before._mallocs < 2 + numThreads * allocsPerThread ||
+      after._frees - before._frees < numThreads * allocsPerThread) {
+    printf("thread counts lost: %lu mallocs %lu frees\n",
+           after._mallocs - before._mallocs, after._frees - before._frees);
+    exit(1);
+  }
+
+  //freeing the two objects takes their bytes back out of live bytes
+  MallocStats beforeFree;
+  stats_get(&beforeFree);
+  free(mem1);
+  free(mem2);
+  stats_get(&after);
+  if (beforeFree._liveBytes - after._liveBytes < 101000) {
+    printf("live bytes %lu, expected %lu less\n", after._liveBytes, beforeFree._liveBytes);
+    exit(1);
+  }
+  printf("%d arenas, %lu contended locks\n", after._arenas, after._lockContention);
+
+  exit(0);
+}
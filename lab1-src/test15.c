@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "MyMalloc.h"
+
+#define numObjects 10
+
+char * ptrs[numObjects];
+
+void allocateTracked(){
+  int i;
+  for (i = 0; i < numObjects; i++ ) {
+    ptrs[i] = (char *) malloc( 1000 );
+    *ptrs[i] = 100;
+  }
+}
+
+// Counts the samples of the profile whose call stack goes through
+// allocateTracked
+int countTracked(const char * path){
+  FILE * f = fopen(path, "r");
+  if (f == NULL) {
+    printf("no profile written\n");
+    exit(1);
+  }
+
+  char line[4096];
+  if (fgets(line, sizeof(line), f) == NULL || strncmp(line, "heap profile:", 13)) {
+    printf("bad profile header\n");
+    exit(1);
+  }
+
+  int tracked = 0;
+  while (fgets(line, sizeof(line), f) != NULL && strcmp(line, "\n")) {
+    char * frame = strchr(line, '@');
+    while (frame && (frame = strstr(frame, " 0x")) != NULL) {
+      unsigned long pc = strtoul(frame + 1, &frame, 16);
+      if (pc > (unsigned long) allocateTracked && pc < (unsigned long) allocateTracked + 256) {
+        tracked++;
+        break;
+      }
+    }
+  }
+  if (fgets(line, sizeof(line), f) == NULL || strcmp(line, "MAPPED_LIBRARIES:\n")) {
+    printf("no mapped libraries\n");
+    exit(1);
+  }
+  fclose(f);
+  return tracked;
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test15 ---\n");
+  printf("Heap profile of sampled allocations\n");
+
+  //an interval of one byte samples every allocation
+  profile_start(1);
+  allocateTracked();
+  profile_dump("test15.heap");
+  int tracked = countTracked("test15.heap");
+  printf("%d samples from allocateTracked\n", tracked);
+  if (tracked != numObjects) {
+    exit(1);
+  }
+
+  //freed objects leave the profile
+  int i;
+  for (i = 0; i < numObjects; i++ ) {
+    free(ptrs[i]);
+  }
+  profile_dump("test15.heap");
+  tracked = countTracked("test15.heap");
+  printf("%d samples from allocateTracked after free\n", tracked);
+  if (tracked != 0) {
+    exit(1);
+  }
+
+  profile_start(0);
+  remove("test15.heap");
+  exit(0);
+}
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include "MyMalloc.h"
+
+static void checkAligned( void * ptr, size_t alignment, size_t size )
+{
+  if (ptr == NULL || ((unsigned long) ptr & (alignment - 1))) {
+    printf("%p is not aligned to %lu\n", ptr, alignment);
+    exit(1);
+  }
+  if (objectSize(ptr) < size) {
+    printf("%p holds %lu bytes, not %lu\n", ptr, objectSize(ptr), size);
+    exit(1);
+  }
+  memset(ptr, 0xAB, size);
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test16 ---\n");
+  printf("Aligned allocation\n");
+
+  //small alignments come from the slab of the rounded up size
+  void * small[ 64 ];
+  int i;
+  for ( i = 0; i < 64; i++ ) {
+    size_t alignment = 8 << (i % 4);
+    if (posix_memalign(&small[ i ], alignment, 1 + i * 3) != 0) {
+      printf("posix_memalign(%lu, %d) failed\n", alignment, 1 + i * 3);
+      exit(1);
+    }
+    checkAligned(small[ i ], alignment, 1 + i * 3);
+    if (_slabsEnabled && !is_slab(small[ i ])) {
+      printf("posix_memalign(%lu, %d) did not come from a slab\n", alignment, 1 + i * 3);
+      exit(1);
+    }
+  }
+
+  //bigger alignments are carved out of a chunk without keeping the slack
+  char * page = (char *) memalign( 4096, 1000 );
+  checkAligned(page, 4096, 1000);
+  if (objectSize(page) > 1024) {
+    printf("memalign(4096, 1000) took %lu bytes\n", objectSize(page));
+    exit(1);
+  }
+  char * line = (char *) aligned_alloc( 256, 3000 );
+  checkAligned(line, 256, 3000);
+  print_list();
+
+  //alignments beyond the arena are mapped on their own
+  char * huge = (char *) memalign( 2097152, 1000000 );
+  checkAligned(huge, 2097152, 1000000);
+  if (objectSize(huge) > 1000000 + 4096) {
+    printf("memalign(2MB, 1000000) kept %lu bytes\n", objectSize(huge));
+    exit(1);
+  }
+  huge = (char *) realloc( huge, 3000000 );
+  if (huge == NULL || huge[ 999999 ] != (char) 0xAB) {
+    printf("realloc of an aligned large object lost its contents\n");
+    exit(1);
+  }
+
+  //bad alignments
+  void * ptr;
+  if (posix_memalign(&ptr, 24, 100) != EINVAL || aligned_alloc(48, 100) != NULL) {
+    printf("alignments that are not a power of two were accepted\n");
+    exit(1);
+  }
+  char * odd = (char *) memalign( 48, 100 );
+  checkAligned(odd, 64, 100);
+
+  for ( i = 0; i < 64; i++ ) {
+    free(small[ i ]);
+  }
+  free(page);
+  free(line);
+  free(huge);
+  free(odd);
+  print_list();
+
+  exit(0);
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "MyMalloc.h"
+
+#define count 200
+
+static void fill( void ** ptrs, size_t n, size_t size )
+{
+  size_t i;
+  for ( i = 0; i < n; i++ ) {
+    if (objectSize(ptrs[ i ]) < size) {
+      printf("object %lu holds %lu bytes, not %lu\n", i, objectSize(ptrs[ i ]), size);
+      exit(1);
+    }
+    memset(ptrs[ i ], (int) i, size);
+  }
+  for ( i = 0; i < n; i++ ) {
+    if (((unsigned char *) ptrs[ i ])[ size - 1 ] != (unsigned char) i) {
+      printf("object %lu overlaps another one\n", i);
+      exit(1);
+    }
+  }
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test17 ---\n");
+  printf("Batch allocation and free\n");
+
+  void * small[ count ];
+  void * medium[ count ];
+  void * large[ 3 ];
+  if (malloc_batch(40, count, small) != count ||
+      malloc_batch(1000, count, medium) != count ||
+      malloc_batch(300000, 3, large) != 3) {
+    printf("malloc_batch came up short\n");
+    exit(1);
+  }
+  fill(small, count, 40);
+  fill(medium, count, 1000);
+  fill(large, 3, 300000);
+
+  //the medium objects are carved from one block
+  int i;
+  for ( i = 1; i < count; i++ ) {
+    if ((char *) medium[ i ] != (char *) medium[ i - 1 ] + 1008) {
+      printf("medium[%d] does not follow medium[%d]\n", i, i - 1);
+      exit(1);
+    }
+  }
+  print_list();
+
+  //free every other object on its own, then the rest at once
+  void * rest[ count / 2 ];
+  for ( i = 0; i < count; i++ ) {
+    if (i % 2)
+      rest[ i / 2 ] = medium[ i ];
+    else
+      medium[ i / 2 ] = medium[ i ];
+  }
+  free_batch(medium, count / 2);
+  print_list();
+  free_batch(rest, count / 2);
+  free_batch(small, count);
+  free_batch(large, 3);
+  print_list();
+
+  MallocStats stats;
+  stats_get(&stats);
+  if (stats._liveBytes > 8192) {
+    printf("%lu bytes are still live\n", stats._liveBytes);
+    exit(1);
+  }
+
+  exit(0);
+}
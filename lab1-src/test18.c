@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "MyMalloc.h"
+
+#define count 100000
+
+char * nodes[ count ];
+
+static void fillRegion( Region * region )
+{
+  int i;
+  for ( i = 0; i < count; i++ ) {
+    nodes[ i ] = (char *) region_alloc( region, 40 + i % 9 );
+    if (nodes[ i ] == NULL || ((unsigned long) nodes[ i ] & 15)) {
+      printf("region_alloc returned %p\n", nodes[ i ]);
+      exit(1);
+    }
+    memset(nodes[ i ], i, 40);
+  }
+  for ( i = 0; i < count; i++ ) {
+    if (nodes[ i ][ 39 ] != (char) i) {
+      printf("node %d overlaps another one\n", i);
+      exit(1);
+    }
+  }
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test18 ---\n");
+  printf("Regions\n");
+
+  char * before = (char *) malloc( 100 );
+  size_t heapBefore = _heapSize;
+
+  Region * region = region_create();
+  fillRegion(region);
+  char * first = nodes[ 0 ];
+  char * big = (char *) region_alloc( region, 5000000 );
+  memset(big, 1, 5000000);
+  size_t heapFilled = _heapSize;
+  printf("heap grew by %lu bytes\n", heapFilled - heapBefore);
+
+  //a reset reuses the same chunks
+  region_reset(region);
+  fillRegion(region);
+  big = (char *) region_alloc( region, 5000000 );
+  if (nodes[ 0 ] != first || _heapSize != heapFilled) {
+    printf("region_reset did not reuse the region's chunks\n");
+    exit(1);
+  }
+
+  region_destroy(region);
+  if (_heapSize != heapBefore) {
+    printf("region_destroy left %lu bytes mapped\n", _heapSize - heapBefore);
+    exit(1);
+  }
+
+  free(before);
+  exit(0);
+}
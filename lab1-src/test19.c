@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "MyMalloc.h"
+
+#define count 60
+
+volatile int forking = 1;
+
+//keeps taking the statistics' lock while the main thread forks
+void * reader( void * arg )
+{
+  MallocStats stats;
+  while (forking)
+    stats_get(&stats);
+  return NULL;
+}
+
+void * worker( void * arg )
+{
+  free(malloc( 100 ));
+  return NULL;
+}
+
+int
+main( int argc, char **argv )
+{
+  //the decay time is read when the heap starts up, so the test runs itself
+  //again
+  if (getenv("MALLOCDECAY") == NULL) {
+    setenv("MALLOCDECAY", "100", 1);
+    setenv("MALLOCMMAPTHRESHOLD", "99999999", 1);
+    execv(argv[ 0 ], argv);
+    exit(1);
+  }
+
+  printf("\n---- Running test19 ---\n");
+  printf("Decay of free pages\n");
+
+  //the first frees come after the heap grew; whatever starting the decay
+  //thread allocated must not keep one of the new chunks mapped
+  char * big[ 8 ];
+  int i;
+  for ( i = 0; i < 8; i++ )
+    big[ i ] = (char *) malloc( 1500000 );
+  for ( i = 0; i < 8; i++ )
+    free(big[ i ]);
+  if (_heapSize > (size_t)(1 + _retainChunks) * 2097152) {
+    printf("%lu bytes are still mapped after the first frees\n", _heapSize);
+    exit(1);
+  }
+
+  //the guards keep the buffers apart and their chunks mapped
+  char * buffers[ count ];
+  char * guards[ count ];
+  for ( i = 0; i < count; i++ ) {
+    buffers[ i ] = (char *) malloc( 60000 );
+    guards[ i ] = (char *) malloc( 600 );
+    memset(buffers[ i ], 1, 60000);
+    memset(guards[ i ], i, 600);
+  }
+  for ( i = 0; i < count; i++ ) {
+    free(buffers[ i ]);
+  }
+
+  size_t resident = residentBytes();
+  usleep(500000);
+  size_t decayed = residentBytes();
+  printf("resident %lu bytes, %lu bytes after decay\n", resident, decayed);
+  if (resident - decayed < count * 40000 || _purgedSize < count * 40000) {
+    printf("free runs were not purged\n");
+    exit(1);
+  }
+
+  //purged runs are allocated like any other
+  for ( i = 0; i < count; i++ ) {
+    buffers[ i ] = (char *) malloc( 60000 );
+    memset(buffers[ i ], 2, 60000);
+  }
+  for ( i = 0; i < count; i++ ) {
+    if (guards[ i ][ 599 ] != (char) i) {
+      printf("decay cleared guard %d\n", i);
+      exit(1);
+    }
+    free(buffers[ i ]);
+    free(guards[ i ]);
+  }
+
+  //a fork while the decay thread and the reader run leaves the child no
+  //lock held; a new thread takes a statistics shard under its lock
+  pthread_t thread;
+  pthread_create(&thread, NULL, reader, NULL);
+  for ( i = 0; i < 50; i++ ) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      alarm(5);
+      free(malloc( 60000 ));
+      pthread_t child;
+      pthread_create(&child, NULL, worker, NULL);
+      pthread_join(child, NULL);
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status)) {
+      printf("child %d hung\n", i);
+      exit(1);
+    }
+    usleep(10000);
+  }
+  forking = 0;
+  pthread_join(thread, NULL);
+
+  exit(0);
+}
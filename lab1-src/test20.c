@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "MyMalloc.h"
+
+void * worker( void * arg )
+{
+  int i;
+  for ( i = 0; i < 3000; i++ ) {
+    free(malloc( 64 ));
+  }
+  return NULL;
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test20 ---\n");
+  printf("Trace recorder\n");
+
+  if (!trace_start("test20.trace")) {
+    printf("could not create test20.trace\n");
+    exit(1);
+  }
+
+  char * a = (char *) malloc( 100 );
+  char * b = (char *) realloc( a, 2000 );
+  char * c = (char *) calloc( 10, 10 );
+  free(b);
+  free(c);
+
+  //the worker's records are written when it exits
+  pthread_t thread;
+  pthread_create(&thread, NULL, worker, NULL);
+  pthread_join(thread, NULL);
+  trace_flush();
+
+  TraceRecord records[ 7000 ];
+  int fd = open("test20.trace", O_RDONLY);
+  int count = read(fd, records, sizeof(records)) / sizeof(TraceRecord);
+  close(fd);
+  printf("%d records\n", count);
+
+  //the main thread's calls are recorded in order, between the ones the
+  //library makes itself
+  TraceRecord expected[ 5 ] = {
+    { 0, 100, (unsigned long) a, 0, 0, TRACE_MALLOC },
+    { 0, 2000, (unsigned long) b, (unsigned long) a, 0, TRACE_REALLOC },
+    { 0, 100, (unsigned long) c, 0, 0, TRACE_CALLOC },
+    { 0, 0, (unsigned long) b, 0, 0, TRACE_FREE },
+    { 0, 0, (unsigned long) c, 0, 0, TRACE_FREE },
+  };
+  int i, mine = 0, worker = 0;
+  unsigned int main = 0;
+  for ( i = 0; i < count; i++ ) {
+    if (records[ i ]._op == TRACE_MALLOC && records[ i ]._ptr == (unsigned long) a)
+      main = records[ i ]._thread;
+  }
+  unsigned long lastTime = 0;
+  for ( i = 0; i < count; i++ ) {
+    TraceRecord * r = &records[ i ];
+    if (r->_thread == main) {
+      if (mine < 5 && r->_op == expected[ mine ]._op && r->_size == expected[ mine ]._size &&
+          r->_ptr == expected[ mine ]._ptr && r->_arg == expected[ mine ]._arg)
+        mine++;
+    } else if (r->_op == TRACE_MALLOC || r->_op == TRACE_FREE) {
+      //the worker wrote its records when it exited
+      if (r->_time <= lastTime) {
+        printf("the worker's records are out of order\n");
+        exit(1);
+      }
+      lastTime = r->_time;
+      worker++;
+    }
+  }
+  if (mine < 5 || worker < 6000) {
+    printf("%d calls of the main thread recorded, %d of the worker\n", mine, worker);
+    exit(1);
+  }
+
+  unlink("test20.trace");
+  exit(0);
+}
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "MyMalloc.h"
+
+static void expect( const char * what, void * ptr, int kind, void * owner )
+{
+  unsigned long entry = pagemap_get(ptr);
+  if (PAGE_KIND(entry) != kind || PAGE_OWNER(entry) != owner) {
+    printf("%s: page map has kind %d owner %p, not kind %d owner %p\n", what,
+           PAGE_KIND(entry), PAGE_OWNER(entry), kind, owner);
+    exit(1);
+  }
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test21 ---\n");
+  printf("Page map\n");
+
+  char * small = (char *) malloc( 40 );
+  char * medium = (char *) malloc( 5000 );
+  char * large = (char *) malloc( 1000000 );
+  expect("small", small, PAGE_SLAB, SLAB_OF(small));
+  expect("medium", medium, PAGE_ARENA, CHUNK_OF(medium));
+  expect("medium's last byte", medium + 4999, PAGE_ARENA, CHUNK_OF(medium));
+  expect("large", large, PAGE_LARGE, (LargeObject *) large - 1);
+  expect("large's last byte", large + 999999, PAGE_LARGE, (LargeObject *) large - 1);
+
+  //pointers the allocator never handed out are left alone
+  char local[ 64 ];
+  char * volatile foreign = local;
+  expect("stack", foreign, 0, NULL);
+  free(foreign);
+  errno = 0;
+  if (realloc(foreign, 100) != NULL || errno != EINVAL) {
+    printf("realloc took a pointer that is not from the heap\n");
+    exit(1);
+  }
+
+  //a large object that moves takes its entries along
+  char * grown = (char *) realloc( large, 50000000 );
+  memset(grown, 1, 50000000);
+  expect("grown", grown + 40000000, PAGE_LARGE, (LargeObject *) grown - 1);
+  if (grown != large)
+    expect("moved", large, 0, NULL);
+  free(grown);
+  expect("freed", grown + 40000000, 0, NULL);
+
+  free(small);
+  free(medium);
+  exit(0);
+}
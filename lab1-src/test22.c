@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include "MyMalloc.h"
+
+#define FIZ "../lab2-src/fiz/fiz"
+
+//operator new and sized operator delete, under their mangled names
+extern void * cxxNew( size_t size ) __asm__("_Znwm");
+extern void cxxDeleteSized( void * ptr, size_t size ) __asm__("_ZdlPvm");
+
+// The lab2 test programs, each followed by a few calls of its functions
+const char * programs[][ 2 ] = {
+  { "../lab2-src/fiz/test1.f", "(isp 97)\n(isp 91)\n" },
+  { "../lab2-src/fiz/test2.f", "(fac 5)\n(gcd 84 36)\n" },
+  { "../lab2-src/fiz/fizcode.f", "(sroot 50)\n(minv 3 7)\n(lcm 4 6)\n" },
+  { "../lab2-src/tf1.f", "" },
+  { "../lab2-src/tf2.f", "" },
+  { "../lab2-src/tf3.f", "" },
+  { "../lab2-src/tf4.f", "" },
+};
+
+//runs fiz on test22.fiz and returns what it printed, with MyMalloc.so
+//preloaded if preload is set
+static char * runFiz( int preload )
+{
+  const char * output = preload ? "test22.preload.out" : "test22.system.out";
+  pid_t pid = fork();
+  if (pid == 0) {
+    int in = open("test22.fiz", O_RDONLY);
+    int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(in, 0);
+    dup2(out, 1);
+    dup2(out, 2);
+    if (preload) {
+      setenv("LD_PRELOAD", "./MyMalloc.so", 1);
+      setenv("MALLOCVERBOSE", "NO", 1);
+    }
+    execl(FIZ, FIZ, (char *) NULL);
+    exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("fiz %s MyMalloc.so failed with status %x\n", preload ? "with" : "without", status);
+    exit(1);
+  }
+
+  FILE * f = fopen(output, "r");
+  char * text = (char *) calloc(1, 65536);
+  fread(text, 1, 65535, f);
+  fclose(f);
+  unlink(output);
+  return text;
+}
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test22 ---\n");
+  printf("Allocation ABI\n");
+
+  char * p = (char *) valloc( 100 );
+  char * q = (char *) pvalloc( 5000 );
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (((unsigned long) p | (unsigned long) q) & (pageSize - 1) ||
+      malloc_usable_size(q) < 2 * pageSize) {
+    printf("valloc or pvalloc returned %p and %p\n", p, q);
+    exit(1);
+  }
+  volatile size_t huge = (size_t) 1 << 40;
+  errno = 0;
+  if (reallocarray(p, huge, huge) != NULL || errno != ENOMEM) {
+    printf("reallocarray did not catch the overflow\n");
+    exit(1);
+  }
+  p = (char *) reallocarray( p, 30, 10 );
+  if (malloc_usable_size(p) < 300 || malloc_usable_size(NULL) != 0) {
+    printf("malloc_usable_size says %lu\n", malloc_usable_size(p));
+    exit(1);
+  }
+  free(p);
+  free(q);
+
+  //new is as aligned as __STDCPP_DEFAULT_NEW_ALIGNMENT__, and sized delete
+  //finds the slot new took
+  size_t size;
+  for ( size = 1; size <= 1024; size++ ) {
+    char * object = (char *) cxxNew( size );
+    if ((unsigned long) object & 15) {
+      printf("new of %lu bytes returned %p\n", size, object);
+      exit(1);
+    }
+    memset(object, 1, size);
+    cxxDeleteSized(object, size);
+  }
+  MallocStats stats;
+  stats_get(&stats);
+  if (stats._liveBytes > 8192) {
+    printf("%lu bytes are still live after sized deletes\n", stats._liveBytes);
+    exit(1);
+  }
+
+  if (access(FIZ, X_OK) != 0 || access("MyMalloc.so", R_OK) != 0) {
+    printf("%s or MyMalloc.so is missing\n", FIZ);
+    exit(1);
+  }
+  unsigned int i;
+  for ( i = 0; i < sizeof(programs) / sizeof(programs[ 0 ]); i++ ) {
+    //the program and the calls go into one input
+    FILE * source = fopen(programs[ i ][ 0 ], "r");
+    FILE * input = fopen("test22.fiz", "w");
+    int c;
+    while ((c = getc(source)) != EOF)
+      putc(c, input);
+    fputs(programs[ i ][ 1 ], input);
+    fclose(source);
+    fclose(input);
+
+    char * expected = runFiz(0);
+    char * actual = runFiz(1);
+    if (strcmp(expected, actual) != 0) {
+      printf("fiz prints something else under MyMalloc.so for %s:\n%s\n----\n%s\n",
+             programs[ i ][ 0 ], expected, actual);
+      exit(1);
+    }
+    printf("%s: %lu bytes of output match\n", programs[ i ][ 0 ], strlen(expected));
+    free(expected);
+    free(actual);
+  }
+  unlink("test22.fiz");
+
+  exit(0);
+}
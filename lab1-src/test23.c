@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "MyMalloc.h"
+
+void * worker( void * arg )
+{
+  int i;
+  for ( i = 0; i < 20000; i++ ) {
+    free(malloc( 100 + i % 3000 ));
+    free(malloc( 40 ));
+  }
+  return NULL;
+}
+
+int
+main( int argc, char **argv )
+{
+  //lock statistics are turned on when the heap starts up, so the test runs
+  //itself again
+  if (getenv("MALLOCLOCKSTATS") == NULL) {
+    setenv("MALLOCLOCKSTATS", "YES", 1);
+    execv(argv[ 0 ], argv);
+    exit(1);
+  }
+
+  printf("\n---- Running test23 ---\n");
+  printf("Lock statistics\n");
+
+  pthread_t threads[ 4 ];
+  int i;
+  for ( i = 0; i < 4; i++ )
+    pthread_create(&threads[ i ], NULL, worker, NULL);
+  for ( i = 0; i < 4; i++ )
+    pthread_join(threads[ i ], NULL);
+  char * large = (char *) malloc( 1000000 );
+  free(large);
+
+  MallocStats stats;
+  stats_get(&stats);
+  int k;
+  for ( k = 0; k < NUM_LOCK_KINDS; k++ ) {
+    LockStats * lock = &stats._locks[ k ];
+    unsigned long holds = 0;
+    for ( i = 0; i < LOCK_HOLD_BUCKETS; i++ )
+      holds += lock->_holds[ i ];
+    //every lock taken was also given back
+    if (holds != lock->_acquisitions || lock->_contended > lock->_acquisitions) {
+      printf("lock kind %d: %lu taken, %lu contended, %lu held\n", k,
+             lock->_acquisitions, lock->_contended, holds);
+      exit(1);
+    }
+  }
+  if (stats._locks[ LOCK_ARENA ]._acquisitions == 0 || stats._locks[ LOCK_SLAB ]._acquisitions == 0 ||
+      stats._locks[ LOCK_LARGE ]._acquisitions == 0) {
+    printf("the arena, slab or large object locks were not counted\n");
+    exit(1);
+  }
+
+  exit(0);
+}
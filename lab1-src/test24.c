@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+#define count 200
+#define runs 200
+
+static int quickObjects()
+{
+  int a, total = 0;
+  for ( a = 0; a < _numArenas; a++ )
+    total += _arenas[ a ]._quickCount;
+  return total;
+}
+
+int
+main( int argc, char **argv )
+{
+  //the policy is read when the heap starts up, so the test runs itself again
+  if (getenv("MALLOCFIT") == NULL) {
+    setenv("MALLOCFIT", "ADDRESS", 1);
+    setenv("MALLOCSLABS", "NO", 1);
+    setenv("MALLOCDECAY", "100", 1);
+    execv(argv[ 0 ], argv);
+    exit(1);
+  }
+
+  printf("\n---- Running test24 ---\n");
+  printf("Address order and quick lists\n");
+
+  char * a[ count ];
+  char * b[ count ];
+  int i, j;
+  for ( i = 0; i < count; i++ )
+    a[ i ] = (char *) malloc( 100 );
+
+  //what the thread cache cannot hold waits in the quick lists
+  for ( i = 0; i < count; i++ )
+    free(a[ i ]);
+  if (quickObjects() == 0) {
+    printf("no object went to a quick list\n");
+    exit(1);
+  }
+
+  //and is handed out again as it is; only what was left in the thread
+  //cache from its last batch may be new
+  int reused = 0;
+  for ( i = 0; i < count; i++ ) {
+    b[ i ] = (char *) malloc( 100 );
+    for ( j = 0; j < count && a[ j ] != b[ i ]; j++ )
+      ;
+    reused += j < count;
+  }
+  if (reused < count - TCACHE_MAX_COUNT) {
+    printf("only %d of %d objects came back from the quick lists\n", reused, count);
+    exit(1);
+  }
+  for ( i = 0; i < count; i++ )
+    free(b[ i ]);
+  print_list();
+  if (quickObjects() != 0) {
+    printf("%d objects are still waiting after a sweep\n", quickObjects());
+    exit(1);
+  }
+
+  //two holes above the rest of the chunk: best fit would take the smaller
+  //one, address order takes the rest of the chunk below them
+  char * high = (char *) malloc( 20000 );
+  char * guard1 = (char *) malloc( 1000 );
+  char * low = (char *) malloc( 10000 );
+  char * guard2 = (char *) malloc( 1000 );
+  free(high);
+  free(low);
+  char * fit = (char *) malloc( 5000 );
+  if (fit >= low) {
+    printf("malloc took %p, not the lowest chunk that fits\n", fit);
+    exit(1);
+  }
+
+  free(fit);
+  free(guard1);
+  free(guard2);
+
+  //the tree is not ordered by size, so free chunks too small to purge are
+  //mixed in with the runs, but decay still finds every run
+  char * buffers[ runs ];
+  char * holes[ runs ];
+  char * guards[ 2 * runs ];
+  for ( i = 0; i < runs; i++ ) {
+    buffers[ i ] = (char *) malloc( 20000 );
+    guards[ 2 * i ] = (char *) malloc( 700 );
+    holes[ i ] = (char *) malloc( 1000 );
+    guards[ 2 * i + 1 ] = (char *) malloc( 700 );
+    memset(buffers[ i ], 1, 20000);
+  }
+  size_t purged = _purgedSize;
+  for ( i = 0; i < runs; i++ ) {
+    free(buffers[ i ]);
+    free(holes[ i ]);
+  }
+  usleep(500000);
+  if (_purgedSize - purged < runs * 12000) {
+    printf("decay purged %lu bytes of %d free runs\n", _purgedSize - purged, runs);
+    exit(1);
+  }
+  for ( i = 0; i < 2 * runs; i++ )
+    free(guards[ i ]);
+  exit(0);
+}
@@ -0,0 +1,42 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "MyMalloc.h"
+
+int
+main( int argc, char **argv )
+{
+  //objects this large would get their own mapping; the threshold is read
+  //when the heap starts up, so the test runs itself again
+  if (getenv("MALLOCMMAPTHRESHOLD") == NULL) {
+    setenv("MALLOCMMAPTHRESHOLD", "99999999", 1);
+    execv(argv[ 0 ], argv);
+    exit(1);
+  }
+
+  printf("\n---- Running test8 ---\n");
+  printf("Grow the heap, then give it back to the OS\n");
+
+  //one 1MB object per 2MB chunk
+  char * ptrs[8];
+  int i;
+  for (i = 0; i < 8; i++ ) {
+    ptrs[i] = (char *) malloc( 1500000 );
+    ptrs[i][0] = 1;
+    ptrs[i][1499999] = 1;
+  }
+  printf("After 8 allocations: %zd bytes mapped\n", _heapSize);
+
+  for (i = 0; i < 8; i++ ) {
+    free(ptrs[i]);
+  }
+  printf("After 8 frees: %zd bytes mapped\n", _heapSize);
+
+  if (_heapSize > (size_t)(1 + _retainChunks) * 2097152) {
+    printf("Empty chunks were not released\n");
+    exit(1);
+  }
+
+  exit(0);
+}
@@ -0,0 +1,40 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "MyMalloc.h"
+
+int
+main( int argc, char **argv )
+{
+
+  printf("\n---- Running test9 ---\n");
+  printf("Objects larger than a 2MB chunk\n");
+
+  //bigger than any arena chunk
+  char * mem1 = (char *) malloc( 3 * 1048576 );
+  memset(mem1, 7, 3 * 1048576);
+  printf("mem1 = malloc(3MB): %zd bytes in large objects\n", _largeSize);
+
+  //grow with mremap, contents must survive
+  mem1 = (char *) realloc( mem1, 8 * 1048576 );
+  if (mem1[0] != 7 || mem1[3 * 1048576 - 1] != 7) {
+    printf("realloc lost the contents\n");
+    exit(1);
+  }
+  mem1[8 * 1048576 - 1] = 7;
+  printf("mem1 = realloc(mem1, 8MB): %zd bytes in large objects\n", _largeSize);
+
+  //shrink back below the threshold
+  mem1 = (char *) realloc( mem1, 100 );
+  if (mem1[99] != 7) {
+    printf("realloc lost the contents\n");
+    exit(1);
+  }
+  printf("mem1 = realloc(mem1, 100): %zd bytes in large objects\n", _largeSize);
+
+  free(mem1);
+  print_list();
+
+  exit(0);
+}
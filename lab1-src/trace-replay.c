@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MyMalloc.h"
+
+// Replays a trace recorded with MALLOCTRACE against whatever malloc the
+// process uses: the system's, or MyMalloc.so loaded with LD_PRELOAD. Calls
+// are made one at a time in the order of their times, and every page of an
+// object is touched, so that the resident size reflects the heap's layout.
+//
+//   ./trace-replay mymalloc.1234.trace
+//   LD_PRELOAD=./MyMalloc.so ./trace-replay mymalloc.1234.trace
+
+// Live objects by recorded address. Open addressing with linear probing;
+// deleted slots are filled by shifting later entries back. The table is
+// mapped rather than allocated, so that it stays out of the heap measured.
+typedef struct Slot {
+    unsigned long _id;
+    char *_ptr;
+    size_t _size;
+} Slot;
+
+static Slot *table;
+static unsigned long mask;
+
+static unsigned long slotOf(unsigned long id){
+    return (id >> 4) * 0x9E3779B97F4A7C15UL & mask;
+}
+
+static Slot *lookup(unsigned long id){
+    unsigned long i = slotOf(id);
+    while (table[i]._id != 0) {
+        if (table[i]._id == id)
+            return &table[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void insert(unsigned long id, char *ptr, size_t size){
+    unsigned long i = slotOf(id);
+    while (table[i]._id != 0 && table[i]._id != id)
+        i = (i + 1) & mask;
+    table[i]._id = id;
+    table[i]._ptr = ptr;
+    table[i]._size = size;
+}
+
+static void removeSlot(Slot *slot){
+    unsigned long hole = slot - table;
+    unsigned long i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (table[i]._id == 0)
+            break;
+        // An entry may move back into the hole only if the hole lies
+        // between its home slot and where it is now
+        unsigned long home = slotOf(table[i]._id);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    table[hole]._id = 0;
+}
+
+static int byTime(const void *a, const void *b){
+    const TraceRecord *x = (const TraceRecord *)a;
+    const TraceRecord *y = (const TraceRecord *)b;
+    if (x->_time != y->_time)
+        return x->_time < y->_time ? -1 : 1;
+    return x->_thread < y->_thread ? -1 : x->_thread > y->_thread;
+}
+
+// Anonymous resident bytes of the process
+static size_t anonResident(){
+    static long pageSize;
+    if (!pageSize)
+        pageSize = sysconf(_SC_PAGESIZE);
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    char buffer[128];
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buffer[n] = 0;
+    unsigned long size, resident, shared;
+    if (sscanf(buffer, "%lu %lu %lu", &size, &resident, &shared) != 3)
+        return 0;
+    return (resident - shared) * pageSize;
+}
+
+static void touch(char *ptr, size_t size){
+    size_t i;
+    for (i = 0; i < size; i += 4096)
+        ptr[i] = 1;
+    if (size)
+        ptr[size - 1] = 1;
+}
+
+int main(int argc, char **argv){
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s file.trace\n", argv[0]);
+        exit(1);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        exit(1);
+    }
+    size_t count = st.st_size / sizeof(TraceRecord);
+    if (count == 0) {
+        fprintf(stderr, "%s: no records\n", argv[1]);
+        exit(1);
+    }
+    TraceRecord *records = (TraceRecord *) mmap(NULL, count * sizeof(TraceRecord), PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE, fd, 0);
+    if (records == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    // Each thread's records are in order, but threads wrote theirs in batches
+    qsort(records, count, sizeof(TraceRecord), byTime);
+
+    // There are never more live objects than records
+    unsigned long slots = 1024;
+    while (slots < 2 * count)
+        slots <<= 1;
+    mask = slots - 1;
+    table = (Slot *) mmap(NULL, slots * sizeof(Slot), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    // Let the allocator start up before measuring
+    free(malloc(1));
+    size_t baseline = anonResident();
+
+    size_t live = 0, peakLive = 0, peakResident = 0, sampledLive = 0, unknown = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        TraceRecord *r = &records[i];
+        char *ptr = NULL;
+        Slot *old;
+        switch (r->_op) {
+        case TRACE_MALLOC:
+            ptr = (char *) malloc(r->_size);
+            break;
+        case TRACE_CALLOC:
+            ptr = (char *) calloc(1, r->_size);
+            break;
+        case TRACE_MEMALIGN:
+            if (posix_memalign((void **) &ptr, r->_arg < sizeof(void *) ? sizeof(void *) : r->_arg, r->_size))
+                ptr = NULL;
+            break;
+        case TRACE_REALLOC:
+            old = r->_arg ? lookup(r->_arg) : NULL;
+            if (old) {
+                live -= old->_size;
+                ptr = (char *) realloc(old->_ptr, r->_size);
+                removeSlot(old);
+            } else {
+                unknown += r->_arg != 0;
+                ptr = (char *) malloc(r->_size);
+            }
+            break;
+        case TRACE_FREE:
+            old = lookup(r->_ptr);
+            if (old) {
+                live -= old->_size;
+                free(old->_ptr);
+                removeSlot(old);
+            } else {
+                unknown++;
+            }
+            break;
+        }
+
+        if (ptr) {
+            touch(ptr, r->_size);
+            insert(r->_ptr, ptr, r->_size);
+            live += r->_size;
+            if (live > peakLive)
+                peakLive = live;
+        }
+        // Look at the resident size now and then, and whenever the live
+        // size has grown by a megabyte since the last look
+        if ((i & 1023) == 0 || i == count - 1 || live > sampledLive + 1048576) {
+            size_t resident = anonResident() - baseline;
+            if (resident > peakResident)
+                peakResident = resident;
+            sampledLive = live;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    const char *preload = getenv("LD_PRELOAD");
+    printf("allocator:\t%s\n", preload ? preload : "system");
+    printf("records:\t%zu (%zu of unknown objects)\n", count, unknown);
+    printf("time:\t\t%.3f s (%.0f calls/sec)\n", seconds, count / seconds);
+    printf("peak live:\t%zu bytes\n", peakLive);
+    printf("peak heap:\t%zu bytes\n", peakResident);
+    printf("fragmentation:\t%.1f%%\n",
+           peakResident > peakLive ? 100.0 * (peakResident - peakLive) / peakResident : 0.0);
+    exit(0);
+}